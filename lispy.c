@@ -0,0 +1,4937 @@
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* x86-64 builds get AVX2 kernels, picked at run time (see lvec_avx2) */
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define LVEC_X86
+#endif
+
+/* Scripts are memory-mapped where possible (see linput_open) */
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* 'pmap' and 'preduce' run on worker threads where there are pthreads */
+#ifndef _WIN32
+#include <pthread.h>
+#define LPAR_THREADS
+#endif
+
+#include "lispy.h"
+
+/* Forward Declarations */
+struct lval;
+struct lenv;
+struct lcode;
+typedef struct lval lval;
+typedef struct lenv lenv;
+typedef struct lcode lcode;
+static lenv *lenv_new(void);
+static lenv *lenv_new_frame(void);
+static lenv *lenv_share(lenv *e);
+static void lenv_del(lenv *e);
+static lval *builtin_eval(lenv *e, lval *a);
+static lval *builtin_list(lenv *e, lval *a);
+static lcode *lcode_compile(lval *formals, lval *body);
+static lcode *lcode_share(lcode *c);
+static void lcode_del(lcode *c);
+
+/* Let's define function pointers to allow user-defined operations!
+ *
+ * NOTE: notice the first arg is a pointer to the environment
+ * "To get an lval* we dereference lbuiltin and call it with a lenv* and a
+ * lval*." Therefore lbuiltin must be a function pointer that takes an lenv* and
+ * a lval* and returns a lval*.
+ */
+typedef lval *(*lbuiltin)(lenv *, lval *);
+
+/* Create Enumeration of Possible lval Types */
+enum {
+  LVAL_NUM,
+  LVAL_ERR,
+  LVAL_FUN,
+  LVAL_SYM,
+  LVAL_STR,
+  LVAL_SEXPR,
+  LVAL_QEXPR,
+  LVAL_SEQ
+};
+
+/* Create Enumeration of Possible Error Types */
+enum { LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM };
+
+/*
+ * S-expresisons are a variable length lists of other values (see the syntax
+ * rule below) However, "struct" is fixed sized, so we have to use a double star
+ * pointer to point to a list of "lval"s.
+ *
+ * NOTE: a value only ever uses the fields of its own type, so they share
+ * storage in a union and each value is allocated just big enough for its
+ * type (see lval_alloc). A number or symbol is 16 bytes instead of 80.
+ */
+struct lval {
+  int type;
+
+  /*
+   * NOTE: values are shared rather than deep-copied. "refs" counts the owners
+   * of this value; it is only freed when the last owner calls lval_del, and
+   * anything that wants to mutate it must call lval_own first.
+   */
+  int refs;
+
+  union {
+    long num;
+    /* Error, Symbol and String types have some string data */
+    char *err;
+    char *sym;
+    char *str;
+
+    /*
+     * Function, either a builtin or a lambda (builtin is NULL in this case)
+     *
+     * NOTE: a partial application is a lambda too, but only refers to the
+     * lambda "fn" and the arguments "args" given to it so far; its formals,
+     * body and code are NULL. A call binds into a new frame of its own, so
+     * none of these change once the value exists (see lval_call).
+     */
+    struct {
+      lbuiltin builtin;
+      lval *formals;
+      lval *body;
+      /* The compiled body (see lcode_compile) */
+      lcode *code;
+      lval *fn;
+      lval *args;
+    };
+
+    /*
+     * Lists with up to LVAL_INLINE_CELLS elements keep their cells right
+     * after the struct (see lval_inline_cells), so they need no second
+     * allocation. Longer lists move them to the heap, into storage that
+     * several lists may share (see lcells).
+     *
+     * NOTE: "base" is the start of the storage and "cap" its size, "cell"
+     * points at the first element somewhere inside it. Popping the front
+     * only moves "cell", and appending doubles the storage when it is full.
+     */
+    struct {
+      int count;
+      int cap;
+      lval **cell;
+      lval **base;
+    };
+
+    /* Lazy sequence, the fields are used according to "kind" (see lseq_next) */
+    struct {
+      int kind;
+      long at;
+      long end;
+      long step;
+      lval *src;
+      lval *gen;
+    };
+  };
+};
+
+/*
+ * Slab allocator for lval and lenv nodes
+ *
+ * Nodes are small and created and destroyed all the time, so instead of going
+ * to malloc for each one they are carved out of LSLAB_SIZE blocks ("slabs").
+ * There is one pool per size class (8, 16, ... LSLAB_MAX bytes), each with
+ * its own free list threaded through the freed slots, so every node type
+ * effectively gets its own free list. Slabs are aligned to their size, which
+ * lets lslab_free find the slab header of any slot to keep its live count.
+ */
+#define LSLAB_SIZE 65536
+#define LSLAB_MAX 64
+#define LSLAB_CLASSES (LSLAB_MAX / 8)
+
+typedef struct lslab lslab;
+struct lslab {
+  lslab *next;
+  int live;
+};
+
+typedef struct {
+  void *free;
+  /* Slots of the newest slab that were never handed out */
+  char *bump;
+  char *end;
+  lslab *slabs;
+  /* Set once some slab of this pool became empty, see lslab_release */
+  int empty;
+} lpool;
+
+/*
+ * What 'gc-stats' reports
+ *
+ * NOTE: there is no tracing collector. Values are reference counted and never
+ * mutated once shared, and no value refers to an environment, so they cannot
+ * form cycles and the last lval_del of each one frees it. What is left to
+ * "collect" are the slabs emptied that way, which lslab_release hands back to
+ * the system; its runs are counted as collections.
+ */
+typedef struct {
+  long collections;
+  long slabs_freed;
+  long pause_total_us;
+  long pause_max_us;
+  /* Nodes and bytes currently handed out by lslab_alloc */
+  long live_nodes;
+  long live_bytes;
+  long heap_bytes;
+} lgc_stats;
+
+/*
+ * An interpreter (see lispy.h)
+ *
+ * NOTE: an interpreter allocates from pools of its own and names symbols in a
+ * symbol table of its own, so interpreters share no state at all. "lcur" is
+ * the one the current thread is running, set by the lispy_* entry points; the
+ * code in between finds the pools, statistics and symbols through it instead
+ * of being handed the interpreter in every call.
+ */
+typedef struct lpar lpar;
+
+/* An image whose values are in use (see limage_open) */
+typedef struct limage_mapping limage_mapping;
+struct limage_mapping {
+  char *base;
+  size_t len;
+  int64_t *roots;
+  int64_t nroots;
+  limage_mapping *next;
+};
+
+struct lispy {
+  lpool pools[LSLAB_CLASSES];
+  lgc_stats gc;
+  /* Symbol table (see lval_intern) */
+  char **intern_names;
+  int intern_count;
+  int intern_mask;
+  /* The interned "&", which every call looks for */
+  char *amp;
+  lenv *env;
+  /* Images loaded, which stay mapped until the interpreter goes */
+  limage_mapping *images;
+
+  /*
+   * A worker thread of 'pmap' runs a lispy of its own that only has pools
+   * and statistics, and uses the symbols of the interpreter "root". For a
+   * real interpreter "root" is itself (see lpar).
+   */
+  lispy *root;
+  /* The environment 'pmap' was called in, while it runs */
+  lenv *frozen;
+#ifdef LPAR_THREADS
+  pthread_mutex_t intern_lock;
+  lpar *par;
+#endif
+};
+
+static _Thread_local lispy *lcur;
+
+/* Set while this thread shares values with other threads (see lpar) */
+static _Thread_local int lparallel;
+
+/*
+ * Reference counts of values, environments and code
+ *
+ * NOTE: while 'pmap' or 'preduce' run, threads share values, and counts
+ * change atomically. The rest of the time they are plain increments, which
+ * are a lot cheaper. Reading a count is a plain load either way.
+ */
+static inline void lref_inc(int *refs) {
+  if (__builtin_expect(lparallel, 0)) {
+    __atomic_add_fetch(refs, 1, __ATOMIC_RELAXED);
+  } else {
+    ++*refs;
+  }
+}
+
+static inline int lref_dec(int *refs) {
+  if (__builtin_expect(lparallel, 0)) {
+    return __atomic_sub_fetch(refs, 1, __ATOMIC_ACQ_REL);
+  }
+  return --*refs;
+}
+
+static inline int lref_get(int *refs) {
+  return __atomic_load_n(refs, __ATOMIC_RELAXED);
+}
+
+static inline lslab *lslab_of(void *x) {
+  return (lslab *)((uintptr_t)x & ~(uintptr_t)(LSLAB_SIZE - 1));
+}
+
+/* The first slot of a slab, past its header */
+static inline char *lslab_first(lslab *s) {
+  return (char *)s + ((sizeof(lslab) + 15) & ~(size_t)15);
+}
+
+static void *lslab_alloc(size_t size) {
+  lispy *l = lcur;
+  size = (size + 7) & ~(size_t)7;
+  l->gc.live_nodes++;
+  l->gc.live_bytes += size;
+  if (size > LSLAB_MAX) {
+    return malloc(size);
+  }
+  lpool *p = &l->pools[size / 8 - 1];
+  void *x = p->free;
+  if (x) {
+    p->free = *(void **)x;
+  } else {
+    if (p->bump == NULL || p->bump + size > p->end) {
+      lslab *s = aligned_alloc(LSLAB_SIZE, LSLAB_SIZE);
+      l->gc.heap_bytes += LSLAB_SIZE;
+      s->next = p->slabs;
+      s->live = 0;
+      p->slabs = s;
+      p->bump = lslab_first(s);
+      p->end = (char *)s + LSLAB_SIZE;
+    }
+    x = p->bump;
+    p->bump += size;
+  }
+  lslab_of(x)->live++;
+  return x;
+}
+
+static void lslab_free(void *x, size_t size) {
+  lispy *l = lcur;
+  size = (size + 7) & ~(size_t)7;
+  l->gc.live_nodes--;
+  l->gc.live_bytes -= size;
+  if (size > LSLAB_MAX) {
+    free(x);
+    return;
+  }
+  lpool *p = &l->pools[size / 8 - 1];
+  *(void **)x = p->free;
+  p->free = x;
+  if (--lslab_of(x)->live == 0) {
+    p->empty = 1;
+  }
+}
+
+/*
+ * Give slabs that no longer hold any live node back to the system in one go.
+ *
+ * NOTE: this runs after every top-level expression (see lenv_load). Values are
+ * reference counted, so temporaries are already back on the free lists by
+ * then, but a value created during an evaluation may also outlive it (e.g.
+ * through 'def'), so the evaluation cannot simply be thrown away as a whole
+ * like a bump arena. Instead whole slabs emptied by the evaluation are
+ * released here in bulk.
+ */
+static long lgc_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void lslab_release(void) {
+  lispy *l = lcur;
+  long start = 0;
+  for (int i = 0; i < LSLAB_CLASSES; i++) {
+    lpool *p = &l->pools[i];
+    if (!p->empty) {
+      continue;
+    }
+    p->empty = 0;
+    if (!start) {
+      start = lgc_now_us();
+    }
+
+    /* Unlink free slots that live in empty slabs */
+    void **link = &p->free;
+    while (*link) {
+      if (lslab_of(*link)->live == 0) {
+        *link = *(void **)*link;
+      } else {
+        link = (void **)*link;
+      }
+    }
+
+    lslab **s = &p->slabs;
+    while (*s) {
+      lslab *slab = *s;
+      if (slab->live == 0 && p->bump && lslab_of(p->bump) == slab) {
+        /*
+         * NOTE: keep the slab allocation is going on in, all of it free
+         * again, or a loop that evaluates one small expression after
+         * another gets and frees a whole slab every time
+         */
+        p->bump = lslab_first(slab);
+        s = &slab->next;
+      } else if (slab->live == 0) {
+        *s = slab->next;
+        free(slab);
+        l->gc.slabs_freed++;
+        l->gc.heap_bytes -= LSLAB_SIZE;
+      } else {
+        s = &slab->next;
+      }
+    }
+  }
+
+  if (start) {
+    long pause = lgc_now_us() - start;
+    l->gc.collections++;
+    l->gc.pause_total_us += pause;
+    if (pause > l->gc.pause_max_us) {
+      l->gc.pause_max_us = pause;
+    }
+  }
+}
+
+/*
+ * Take over the pools of the worker "w" (see lpar), with every node it
+ * allocated, and add its statistics to those of "l"
+ */
+static void lslab_adopt(lispy *l, lispy *w) {
+  for (int i = 0; i < LSLAB_CLASSES; i++) {
+    lpool *p = &l->pools[i];
+    lpool *q = &w->pools[i];
+    size_t size = (i + 1) * 8;
+
+    /* Slots never handed out go on the free list too */
+    for (; q->bump && q->bump + size <= q->end; q->bump += size) {
+      *(void **)q->bump = q->free;
+      q->free = q->bump;
+    }
+    if (q->free) {
+      void **last = q->free;
+      while (*last) {
+        last = *last;
+      }
+      *last = p->free;
+      p->free = q->free;
+    }
+    if (q->slabs) {
+      lslab *last = q->slabs;
+      while (last->next) {
+        last = last->next;
+      }
+      last->next = p->slabs;
+      p->slabs = q->slabs;
+    }
+    p->empty |= q->empty;
+    memset(q, 0, sizeof(lpool));
+  }
+
+  l->gc.collections += w->gc.collections;
+  l->gc.slabs_freed += w->gc.slabs_freed;
+  l->gc.pause_total_us += w->gc.pause_total_us;
+  if (w->gc.pause_max_us > l->gc.pause_max_us) {
+    l->gc.pause_max_us = w->gc.pause_max_us;
+  }
+  l->gc.live_nodes += w->gc.live_nodes;
+  l->gc.live_bytes += w->gc.live_bytes;
+  l->gc.heap_bytes += w->gc.heap_bytes;
+  memset(&w->gc, 0, sizeof(lgc_stats));
+}
+
+#define LVAL_INLINE_CELLS 4
+#define LVAL_LIST_SIZE (offsetof(lval, base) + sizeof(lval **))
+
+static inline lval **lval_inline_cells(lval *v) {
+  return (lval **)((char *)v + LVAL_LIST_SIZE);
+}
+
+/*
+ * Heap storage of list cells
+ *
+ * 'head', 'tail' or 'take' of a list that is shared do not copy its cells.
+ * The result is another view into the same storage, its "cell" and "count"
+ * picking out the part it is made of (see lval_slice). Like that, walking a
+ * list with 'head' and 'tail' in Lisp costs O(1) a step rather than O(n).
+ *
+ * NOTE: as long as the storage is not shared, the list using it owns the
+ * elements it shows, like a list with inline cells. Once shared it is the
+ * storage that owns elements "lo" to "hi", so views of it need not own or
+ * free anything themselves; the last of them to go frees the lot. A view
+ * that is mutated gets its own cells first (see lval_own_cells). Views keep
+ * every element of the storage alive, not only the ones they show.
+ */
+typedef struct {
+  int refs;
+  int shared;
+  int lo;
+  int hi;
+  lval *cells[];
+} lcells;
+
+static lcells *lcells_new(int cap) {
+  lcells *b = malloc(sizeof(lcells) + sizeof(lval *) * cap);
+  b->refs = 1;
+  b->shared = 0;
+  b->lo = 0;
+  b->hi = 0;
+  return b;
+}
+
+static inline int lval_inline(lval *v) {
+  return v->base == lval_inline_cells(v);
+}
+
+static inline lcells *lcells_of(lval *v) {
+  return (lcells *)((char *)v->base - offsetof(lcells, cells));
+}
+
+/* Whether "v" shows cells owned by the storage rather than by itself */
+static inline int lval_cells_shared(lval *v) {
+  return !lval_inline(v) && lcells_of(v)->shared;
+}
+
+/* Start a list off empty, on its inline storage */
+static void lval_list_init(lval *v) {
+  v->count = 0;
+  v->cap = LVAL_INLINE_CELLS;
+  v->base = lval_inline_cells(v);
+  v->cell = v->base;
+}
+
+/*
+ * A boxed number, an error, a symbol or a string: the fields of lval up to
+ * the first word of its union, all that these types use
+ *
+ * NOTE: such a value is allocated only this big, so it is written through
+ * this type rather than lval. Writing a 16 byte allocation through a 56 byte
+ * lval is out of bounds as far as the compiler can tell, even where only the
+ * first 16 bytes are touched.
+ */
+typedef struct {
+  int type;
+  int refs;
+  union {
+    long num;
+    char *err;
+    char *sym;
+    char *str;
+  };
+} lval_small;
+
+/* The number of bytes a value of the given type uses */
+static size_t lval_size(int type) {
+  size_t size;
+  switch (type) {
+  case LVAL_NUM:
+  case LVAL_ERR:
+  case LVAL_SYM:
+  case LVAL_STR:
+    size = sizeof(lval_small);
+    break;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    size = LVAL_LIST_SIZE + sizeof(lval *) * LVAL_INLINE_CELLS;
+    break;
+  default:
+    size = sizeof(lval);
+    break;
+  }
+  return size;
+}
+
+/*
+ * Allocate a value of the given type with only the space that type uses
+ *
+ * NOTE: every type starts with "type" and "refs", so those are set through
+ * lval_small whatever the type. Use lval_alloc_small for the types that end
+ * there.
+ */
+static lval *lval_alloc(int type) {
+  lval_small *v = lslab_alloc(lval_size(type));
+  v->type = type;
+  v->refs = 1;
+  return (lval *)v;
+}
+
+static inline lval_small *lval_alloc_small(int type) {
+  return (lval_small *)lval_alloc(type);
+}
+
+/*
+ * Fixnums: numbers in [LVAL_FIXNUM_MIN, LVAL_FIXNUM_MAX] are not allocated at
+ * all. They are stored in the "lval *" itself, shifted left by one with the
+ * lowest bit set. A real lval comes from malloc and is at least 8-byte
+ * aligned, so its lowest bit is always clear. Only numbers outside that range
+ * are boxed in a heap allocated LVAL_NUM.
+ *
+ * NOTE: this means "v->type" and "v->num" must never be read from a value
+ * that may be a number; use lval_type and lval_long instead.
+ */
+#define LVAL_FIXNUM_MIN (LONG_MIN >> 1)
+#define LVAL_FIXNUM_MAX (LONG_MAX >> 1)
+
+static inline int lval_is_fixnum(lval *v) { return (uintptr_t)v & 1; }
+
+static inline int lval_type(lval *v) {
+  return lval_is_fixnum(v) ? LVAL_NUM : v->type;
+}
+
+static inline long lval_long(lval *v) {
+  return lval_is_fixnum(v) ? (long)((intptr_t)v >> 1) : v->num;
+}
+
+static lval *lval_num(long x) {
+  if (x >= LVAL_FIXNUM_MIN && x <= LVAL_FIXNUM_MAX) {
+    return (lval *)(((uintptr_t)x << 1) | 1);
+  }
+  lval_small *v = lval_alloc_small(LVAL_NUM);
+  v->num = x;
+  return (lval *)v;
+}
+
+static lval *lval_err(char *m) {
+  lval_small *v = lval_alloc_small(LVAL_ERR);
+  /*
+   * NOTE: C strings are null terminated, meaning that the final character is
+   * always '\0'; however, "strlen" only returns the length excluding the null
+   * terminator...
+   */
+  v->err = malloc(strlen(m) + 1);
+  strcpy(v->err, m);
+  return (lval *)v;
+}
+
+static lval *lval_str(const char *s, size_t n) {
+  lval_small *v = lval_alloc_small(LVAL_STR);
+  v->str = malloc(n + 1);
+  memcpy(v->str, s, n);
+  v->str[n] = '\0';
+  return (lval *)v;
+}
+
+/*
+ * Symbol table: every symbol name is stored exactly once, in the table of the
+ * interpreter. An LVAL_SYM just points at its interned name, so two symbols
+ * are equal iff their "sym" pointers are equal, and copying a symbol
+ * allocates nothing. Interned names are only freed with the interpreter.
+ *
+ * NOTE: the byte in front of each interned name holds flags about the
+ * symbol. LSYM_LOCAL is set once the symbol gets bound in a lambda's
+ * environment; a symbol without it can only ever be bound at the top level.
+ */
+#define LSYM_LOCAL 1
+
+/* FNV-1a */
+static unsigned long intern_hash(const char *s, size_t n) {
+  unsigned long h = 14695981039346656037UL;
+  for (size_t i = 0; i < n; i++) {
+    h = (h ^ (unsigned char)s[i]) * 1099511628211UL;
+  }
+  return h;
+}
+
+/* The interned copy of the "n" characters at "s" */
+static char *lval_intern_n(const char *s, size_t n) {
+  lispy *l = lcur->root;
+#ifdef LPAR_THREADS
+  /* NOTE: worker threads share the table of their interpreter */
+  if (lparallel) {
+    pthread_mutex_lock(&l->intern_lock);
+  }
+#endif
+  if (l->intern_count * 2 >= l->intern_mask + 1) {
+    /* Grow to keep the table at most half full */
+    int size = l->intern_mask < 0 ? 256 : (l->intern_mask + 1) * 2;
+    char **names = calloc(size, sizeof(char *));
+    for (int i = 0; i <= l->intern_mask; i++) {
+      if (l->intern_names[i]) {
+        char *name = l->intern_names[i];
+        unsigned long h = intern_hash(name, strlen(name)) & (size - 1);
+        while (names[h]) {
+          h = (h + 1) & (size - 1);
+        }
+        names[h] = l->intern_names[i];
+      }
+    }
+    free(l->intern_names);
+    l->intern_names = names;
+    l->intern_mask = size - 1;
+  }
+
+  unsigned long h = intern_hash(s, n) & l->intern_mask;
+  char *name;
+  while ((name = l->intern_names[h])) {
+    if (strncmp(name, s, n) == 0 && name[n] == '\0') {
+      break;
+    }
+    h = (h + 1) & l->intern_mask;
+  }
+  if (!name) {
+    name = malloc(n + 2);
+    name[0] = 0;
+    memcpy(name + 1, s, n);
+    name[n + 1] = '\0';
+    name++;
+    l->intern_names[h] = name;
+    l->intern_count++;
+  }
+#ifdef LPAR_THREADS
+  if (lparallel) {
+    pthread_mutex_unlock(&l->intern_lock);
+  }
+#endif
+  return name;
+}
+
+static char *lval_intern(char *s) { return lval_intern_n(s, strlen(s)); }
+
+static inline int lsym_is_local(char *sym) { return sym[-1] & LSYM_LOCAL; }
+
+/*
+ * NOTE: a symbol is only ever marked once, so threads running lambdas at the
+ * same time (see lpar) find it marked already and leave it alone
+ */
+static inline void lsym_set_local(char *sym) {
+  if (!lsym_is_local(sym)) {
+    sym[-1] |= LSYM_LOCAL;
+  }
+}
+
+/* A symbol of the name "sym", which must be interned already */
+static lval *lval_sym_interned(char *sym) {
+  lval_small *v = lval_alloc_small(LVAL_SYM);
+  v->sym = sym;
+  return (lval *)v;
+}
+
+static lval *lval_sym(char *s) { return lval_sym_interned(lval_intern(s)); }
+
+static lval *lval_fun(lbuiltin func) {
+  lval *v = lval_alloc(LVAL_FUN);
+  v->builtin = func;
+  v->formals = NULL;
+  v->body = NULL;
+  v->code = NULL;
+  v->fn = NULL;
+  v->args = NULL;
+  return v;
+}
+
+static lval *lval_lambda(lval *formals, lval *body) {
+  lval *v = lval_alloc(LVAL_FUN);
+  v->builtin = NULL;
+
+  v->formals = formals;
+  v->body = body;
+  v->code = lcode_compile(formals, body);
+  /* NOTE: the formals get bound in a frame on every call */
+  for (int i = 0; i < formals->count; i++) {
+    lsym_set_local(formals->cell[i]->sym);
+  }
+  v->fn = NULL;
+  v->args = NULL;
+  return v;
+}
+
+static lval *lval_sexpr(void) {
+  lval *v = lval_alloc(LVAL_SEXPR);
+  lval_list_init(v);
+  return v;
+}
+
+static lval *lval_qexpr(void) {
+  lval *v = lval_alloc(LVAL_QEXPR);
+  lval_list_init(v);
+  return v;
+}
+
+static void lval_del(lval *v) {
+  /* NOTE: only the last owner actually frees the value */
+  if (lval_is_fixnum(v) || lref_dec(&v->refs) > 0) {
+    return;
+  }
+
+  switch (v->type) {
+  case LVAL_NUM:
+    break;
+  case LVAL_FUN:
+    if (v->fn) {
+      lval_del(v->fn);
+      lval_del(v->args);
+    } else if (!v->builtin) {
+      lval_del(v->formals);
+      lval_del(v->body);
+      lcode_del(v->code);
+    }
+    break;
+  case LVAL_ERR:
+    free(v->err);
+    break;
+  case LVAL_STR:
+    free(v->str);
+    break;
+  case LVAL_SYM:
+    /* NOTE: the name belongs to the symbol table */
+    break;
+  case LVAL_SEQ:
+    if (v->src) {
+      lval_del(v->src);
+    }
+    if (v->gen) {
+      lval_del(v->gen);
+    }
+    break;
+  case LVAL_QEXPR:
+  case LVAL_SEXPR:
+    if (!lval_inline(v)) {
+      lcells *b = lcells_of(v);
+      if (lref_dec(&b->refs) > 0) {
+        /* NOTE: the elements belong to the storage, see lcells */
+        break;
+      }
+      if (b->shared) {
+        for (int i = b->lo; i < b->hi; i++) {
+          lval_del(b->cells[i]);
+        }
+        free(b);
+        break;
+      }
+    }
+    for (int i = 0; i < v->count; i++) {
+      /* NOTE: recursively! */
+      lval_del(v->cell[i]);
+    }
+    /* NOTE: also free the memory allocated to contain the pointers */
+    if (!lval_inline(v)) {
+      free(lcells_of(v));
+    }
+    break;
+  }
+
+  /* NOTE: free the memory allocated for the "lval" struct itself */
+  lslab_free(v, lval_size(v->type));
+}
+
+/*
+ * Make sure a list has room for "n" cells from its first element on. Space
+ * left at the front by lval_pop is reused once it is at least half of the
+ * storage, otherwise the storage at least doubles, so appending is amortised
+ * O(1).
+ *
+ * NOTE: the list must own its cells (see lval_own).
+ */
+static void lval_reserve(lval *v, int n) {
+  int front = v->cell - v->base;
+  if (front + n <= v->cap) {
+    return;
+  }
+  if (n <= v->cap && front >= v->cap / 2) {
+    memmove(v->base, v->cell, sizeof(lval *) * v->count);
+    v->cell = v->base;
+    return;
+  }
+
+  int cap = v->cap * 2;
+  while (cap < n) {
+    cap *= 2;
+  }
+  lval **base = lcells_new(cap)->cells;
+  memcpy(base, v->cell, sizeof(lval *) * v->count);
+  if (!lval_inline(v)) {
+    free(lcells_of(v));
+  }
+  v->base = base;
+  v->cell = base;
+  v->cap = cap;
+}
+
+static lval *lval_own(lval *v);
+static lval *lval_add(lval *v, lval *x) {
+  v = lval_own(v);
+  lval_reserve(v, v->count + 1);
+  v->count++;
+  v->cell[v->count - 1] = x;
+  return v;
+}
+
+/*
+ * Reader
+ *
+ * The syntactic elements of Lisp are 'symbolic expressions', a.k.a.
+ * 's-expressions' Both programs and data are represented as s-expressions: an
+ * s-expresison may either an 'atom' or 'list'
+ *
+ * Examples of atoms include:
+ *   100
+ *   hyphenated-name
+ *   nil
+ *   *some-global*
+ *
+ * A list is a sequence of either atoms or other lists separated by blancks
+ * and enclosed in parentheses.
+ *
+ * Examples of lists include:
+ *   (1 2 3 4)
+ *   (george kate james joyce)
+ *   (a (b c ) (d (e f)))
+ *   () // empty expression
+ *
+ * The reader turns text into values in a single pass, following the grammar
+ * the REPL always had, plus strings and comments:
+ *
+ *   number  : /-?[0-9]+/ ;
+ *   symbol  : /[a-zA-Z0-9_+\-*\/\\=<>!&]+/ ;
+ *   string  : /"(\\.|[^"])*"/ ;
+ *   sexpr   : '(' <expr>* ')' ;
+ *   qexpr   : '{' <expr>* '}' ;
+ *   expr    : <number> | <symbol> | <string> | <sexpr> | <qexpr> ;
+ *   lispy   : /^/ <expr>* /$/ ;
+ *
+ * with whitespace allowed around every expression. A ';' starts a comment
+ * that runs to the end of the line and is skipped like whitespace, and "\n",
+ * "\t" stand for a newline and a tab in strings. Numbers are converted and
+ * symbols interned straight from the input; only strings are copied, to undo
+ * their escapes. Open lists are kept on a stack of their own rather than the C
+ * stack, so deep nesting cannot overflow it.
+ *
+ * p.s. number could be negative and we allow multiple preceding zeros. As in
+ * the grammar a number stops at the first non-digit, "5a" is 5 followed by a.
+ */
+typedef struct {
+  /* Where the input comes from, for error messages */
+  const char *name;
+  const char *s;
+  const char *end;
+  int line;
+  /* Start of the current line */
+  const char *bol;
+  /* Set to the error message when the input does not parse */
+  char *err;
+} lreader;
+
+static void lreader_init(lreader *r, const char *name, const char *s,
+                         size_t len) {
+  r->name = name;
+  r->s = s;
+  r->end = s + len;
+  r->line = 1;
+  r->bol = s;
+  r->err = NULL;
+}
+
+static inline int lreader_digit(const lreader *r, const char *s) {
+  return s < r->end && *s >= '0' && *s <= '9';
+}
+
+static inline int lreader_symbol(const lreader *r, const char *s) {
+  if (s == r->end) {
+    return 0;
+  }
+  char c = *s;
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || (c && strchr("_+-*/\\=<>!&", c));
+}
+
+/* Skip whitespace and comments, counting lines */
+static void lreader_skip(lreader *r) {
+  for (; r->s < r->end; r->s++) {
+    char c = *r->s;
+    if (c == ';') {
+      while (r->s + 1 < r->end && r->s[1] != '\n' && r->s[1] != '\r') {
+        r->s++;
+      }
+    } else if (c == '\n') {
+      r->line++;
+      r->bol = r->s + 1;
+    } else if (c != ' ' && c != '\t' && c != '\r' && c != '\v' && c != '\f') {
+      break;
+    }
+  }
+}
+
+/* Have reading fail, saying what was expected at the current position */
+static void lreader_fail(lreader *r, char *expected) {
+  char found[32];
+  if (r->s == r->end) {
+    strcpy(found, "end of input");
+  } else if (*r->s == '\n') {
+    strcpy(found, "newline");
+  } else {
+    snprintf(found, sizeof(found), "'%c'", *r->s);
+  }
+
+  int len = snprintf(NULL, 0, "%s:%d:%ld: error: expected %s at %s\n", r->name,
+                     r->line, (long)(r->s - r->bol) + 1, expected, found);
+  r->err = malloc(len + 1);
+  snprintf(r->err, len + 1, "%s:%d:%ld: error: expected %s at %s\n", r->name,
+           r->line, (long)(r->s - r->bol) + 1, expected, found);
+}
+
+/* Read the string at the current position, NULL if it is not terminated */
+static lval *lreader_str(lreader *r) {
+  /* NOTE: unescaping only ever shortens it */
+  const char *s = r->s + 1;
+  char *str = malloc(r->end - s + 1);
+  size_t n = 0;
+  for (; s < r->end && *s != '"'; s++) {
+    if (*s == '\\' && s + 1 < r->end) {
+      s++;
+      str[n++] = *s == 'n' ? '\n' : *s == 't' ? '\t' : *s;
+      continue;
+    }
+    if (*s == '\n') {
+      r->line++;
+      r->bol = s + 1;
+    }
+    str[n++] = *s;
+  }
+
+  r->s = s;
+  if (s == r->end) {
+    free(str);
+    lreader_fail(r, "'\"'");
+    return NULL;
+  }
+  r->s++;
+  lval *v = lval_str(str, n);
+  free(str);
+  return v;
+}
+
+/* Read a number, symbol or string, NULL if there is none */
+static lval *lreader_atom(lreader *r, char *expected) {
+  const char *s = r->s;
+  if (s == r->end) {
+    lreader_fail(r, expected);
+    return NULL;
+  }
+  if (*s == '"') {
+    return lreader_str(r);
+  }
+  if (lreader_digit(r, s) || (*s == '-' && lreader_digit(r, s + 1))) {
+    int neg = *s == '-';
+    s += neg;
+
+    /* NOTE: accumulate negatively, so LONG_MIN can be read too */
+    long x = 0;
+    int overflow = 0;
+    for (; lreader_digit(r, s); s++) {
+      overflow |= __builtin_mul_overflow(x, 10, &x);
+      overflow |= __builtin_sub_overflow(x, *s - '0', &x);
+    }
+    r->s = s;
+    if (overflow || (!neg && x == LONG_MIN)) {
+      return lval_err("invalid number");
+    }
+    return lval_num(neg ? x : -x);
+  }
+
+  if (lreader_symbol(r, s)) {
+    while (lreader_symbol(r, s)) {
+      s++;
+    }
+    lval *v = lval_sym_interned(lval_intern_n(r->s, s - r->s));
+    r->s = s;
+    return v;
+  }
+
+  lreader_fail(r, expected);
+  return NULL;
+}
+
+/*
+ * Read the expression at the current position, NULL (with "err" set) if the
+ * input does not hold one
+ */
+static lval *lreader_expr(lreader *r) {
+  /* The lists opened so far, innermost last */
+  lval **open = NULL;
+  int depth = 0;
+  int cap = 0;
+
+  lval *x;
+  while (1) {
+    lreader_skip(r);
+    char c = r->s < r->end ? *r->s : '\0';
+    if (c == '(' || c == '{') {
+      if (depth == cap) {
+        cap = cap ? cap * 2 : 8;
+        open = realloc(open, sizeof(lval *) * cap);
+      }
+      open[depth++] = c == '(' ? lval_sexpr() : lval_qexpr();
+      r->s++;
+      continue;
+    }
+
+    if (depth == 0) {
+      x = lreader_atom(r, "expression or end of input");
+    } else if (c == (open[depth - 1]->type == LVAL_SEXPR ? ')' : '}')) {
+      x = open[--depth];
+      r->s++;
+    } else {
+      x = lreader_atom(r, open[depth - 1]->type == LVAL_SEXPR
+                              ? "expression or ')'"
+                              : "expression or '}'");
+    }
+
+    if (!x) {
+      while (depth) {
+        lval_del(open[--depth]);
+      }
+      break;
+    }
+    if (depth == 0) {
+      break;
+    }
+    open[depth - 1] = lval_add(open[depth - 1], x);
+  }
+  free(open);
+  return x;
+}
+
+/* Read all of the input as one S-Expression, NULL if it does not parse */
+static lval *lval_read(lreader *r) {
+  lval *x = lval_sexpr();
+  while (1) {
+    lreader_skip(r);
+    if (r->s == r->end) {
+      return x;
+    }
+    lval *y = lreader_expr(r);
+    if (!y) {
+      lval_del(x);
+      return NULL;
+    }
+    x = lval_add(x, y);
+  }
+}
+
+static void lval_print(FILE *f, lval *v);
+static void lval_expr_print(FILE *f, lval *v, char open, char close) {
+  fputc(open, f);
+  for (int i = 0; i < v->count; i++) {
+    lval_print(f, v->cell[i]);
+    if (i != (v->count - 1)) {
+      fputc(' ', f);
+    }
+  }
+  fputc(close, f);
+}
+
+/* Print a string the way it would be written in the input */
+static void lval_print_str(FILE *f, lval *v) {
+  fputc('"', f);
+  for (char *c = v->str; *c; c++) {
+    switch (*c) {
+    case '\n':
+      fputs("\\n", f);
+      break;
+    case '\t':
+      fputs("\\t", f);
+      break;
+    case '"':
+    case '\\':
+      fputc('\\', f);
+      fputc(*c, f);
+      break;
+    default:
+      fputc(*c, f);
+      break;
+    }
+  }
+  fputc('"', f);
+}
+
+static void lval_print(FILE *f, lval *v) {
+  switch (lval_type(v)) {
+  case LVAL_NUM:
+    fprintf(f, "%li", lval_long(v));
+    break;
+  case LVAL_ERR:
+    fprintf(f, "Error: %s", v->err);
+    break;
+  case LVAL_FUN:
+    if (v->builtin) {
+      fprintf(f, "<builtin>");
+    } else if (v->fn) {
+      /* NOTE: shown as a lambda of the formals that are still unbound */
+      lval *formals = v->fn->formals;
+      fprintf(f, "(\\{");
+      for (int i = v->args->count; i < formals->count; i++) {
+        lval_print(f, formals->cell[i]);
+        if (i != formals->count - 1) {
+          fputc(' ', f);
+        }
+      }
+      fprintf(f, "} ");
+      lval_print(f, v->fn->body);
+      fputc(')', f);
+    } else {
+      fprintf(f, "(\\");
+      lval_print(f, v->formals);
+      fputc(' ', f);
+      lval_print(f, v->body);
+      fputc(')', f);
+    }
+    break;
+  case LVAL_SYM:
+    fprintf(f, "%s", v->sym);
+    break;
+  case LVAL_STR:
+    lval_print_str(f, v);
+    break;
+  case LVAL_SEXPR:
+    lval_expr_print(f, v, '(', ')');
+    break;
+  case LVAL_QEXPR:
+    lval_expr_print(f, v, '{', '}');
+    break;
+  case LVAL_SEQ:
+    fprintf(f, "<sequence>");
+    break;
+  }
+}
+
+static void lval_println(FILE *f, lval *v) {
+  lval_print(f, v);
+  fputc('\n', f);
+}
+
+/*
+ * Hand out another reference to a value. This is what lenv_get and lenv_put
+ * use instead of copying, so looking up a lambda costs a counter increment.
+ */
+static lval *lval_share(lval *v) {
+  if (!lval_is_fixnum(v)) {
+    lref_inc(&v->refs);
+  }
+  return v;
+}
+
+/*
+ * Copy the top level of a value. Children are shared, not copied: they are
+ * copied in turn only if somebody later mutates them through lval_own.
+ */
+static lval *lval_copy(lval *v) {
+  if (lval_is_fixnum(v)) {
+    return v;
+  }
+  switch (v->type) {
+  /* Copy Numbers Directly and Strings using malloc, symbols are interned */
+  case LVAL_NUM:
+    return lval_num(v->num);
+  case LVAL_ERR:
+    return lval_err(v->err);
+  case LVAL_STR:
+    return lval_str(v->str, strlen(v->str));
+  case LVAL_SYM:
+    return lval_sym_interned(v->sym);
+  }
+
+  lval *x = lval_alloc(v->type);
+  switch (v->type) {
+  /* Copy Functions Directly */
+  case LVAL_FUN:
+    x->builtin = v->builtin;
+    x->formals = NULL;
+    x->body = NULL;
+    x->code = NULL;
+    x->fn = NULL;
+    x->args = NULL;
+    if (v->fn) {
+      x->fn = lval_share(v->fn);
+      x->args = lval_share(v->args);
+    } else if (!v->builtin) {
+      x->formals = lval_share(v->formals);
+      x->body = lval_share(v->body);
+      x->code = lcode_share(v->code);
+    }
+    break;
+
+  /* Copy Lists by sharing each sub-expression */
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    lval_list_init(x);
+    lval_reserve(x, v->count);
+    x->count = v->count;
+    for (int i = 0; i < x->count; i++) {
+      x->cell[i] = lval_share(v->cell[i]);
+    }
+    break;
+  case LVAL_SEQ:
+    x->kind = v->kind;
+    x->at = v->at;
+    x->end = v->end;
+    x->step = v->step;
+    x->src = v->src ? lval_share(v->src) : NULL;
+    x->gen = v->gen ? lval_share(v->gen) : NULL;
+    break;
+  }
+  return x;
+}
+
+/*
+ * Give the list "v", which has no other owner, cells of its own if the ones
+ * it shows belong to shared storage (see lcells)
+ */
+static void lval_own_cells(lval *v) {
+  if (!lval_cells_shared(v)) {
+    return;
+  }
+  lcells *b = lcells_of(v);
+  int lo = v->cell - b->cells;
+  int hi = lo + v->count;
+  if (lref_get(&b->refs) == 1) {
+    /* NOTE: the last view left, so it can take the storage over */
+    for (int i = b->lo; i < lo; i++) {
+      lval_del(b->cells[i]);
+    }
+    for (int i = hi; i < b->hi; i++) {
+      lval_del(b->cells[i]);
+    }
+    b->shared = 0;
+    return;
+  }
+
+  lref_dec(&b->refs);
+  lval **cell = v->cell;
+  int n = v->count;
+  lval_list_init(v);
+  lval_reserve(v, n);
+  for (int i = 0; i < n; i++) {
+    v->cell[i] = lval_share(cell[i]);
+  }
+  v->count = n;
+}
+
+/*
+ * Make sure the caller is the only owner of "v" before it gets mutated
+ * (copy-on-write). Consumes the caller's reference and returns a value the
+ * caller owns exclusively.
+ */
+static lval *lval_own(lval *v) {
+  if (lval_is_fixnum(v)) {
+    return v;
+  }
+  if (lref_get(&v->refs) == 1) {
+    if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+      lval_own_cells(v);
+    }
+    return v;
+  }
+  lval *x = lval_copy(v);
+  lval_del(v);
+  return x;
+}
+
+/*
+ * Another list showing the same cells as the list "v" (consumed), which must
+ * keep them on the heap (see lcells)
+ */
+static lval *lval_view(lval *v) {
+  lcells *b = lcells_of(v);
+  if (!b->shared) {
+    b->shared = 1;
+    b->lo = v->cell - b->cells;
+    b->hi = b->lo + v->count;
+  }
+  lref_inc(&b->refs);
+
+  lval *x = lval_alloc(v->type);
+  x->count = v->count;
+  x->cap = v->cap;
+  x->base = v->base;
+  x->cell = v->cell;
+  lval_del(v);
+  return x;
+}
+
+/*
+ * The "n" elements of the list "v" (consumed) from element "from" on. If "v"
+ * is shared the result is a view of its cells (see lcells), so this is O(1)
+ * however long "v" is.
+ */
+static lval *lval_slice(lval *v, int from, int n) {
+  /*
+   * NOTE: making a view writes to the storage, which other threads may be
+   * reading while 'pmap' runs, so the elements are copied then instead
+   */
+  int shared = lref_get(&v->refs) > 1;
+  if (shared && (lval_inline(v) || lparallel)) {
+    lval *x = lval_alloc(v->type);
+    lval_list_init(x);
+    lval_reserve(x, n);
+    for (int i = 0; i < n; i++) {
+      x->cell[i] = lval_share(v->cell[from + i]);
+    }
+    x->count = n;
+    lval_del(v);
+    return x;
+  }
+  if (shared) {
+    v = lval_view(v);
+  }
+
+  if (!lval_cells_shared(v)) {
+    /* NOTE: "v" owns its elements, so the ones left out go now */
+    for (int i = 0; i < from; i++) {
+      lval_del(v->cell[i]);
+    }
+    for (int i = from + n; i < v->count; i++) {
+      lval_del(v->cell[i]);
+    }
+  }
+  v->cell += from;
+  v->count = n;
+  if (n == 0 && !lval_cells_shared(v)) {
+    v->cell = v->base;
+  }
+  return v;
+}
+
+/*
+ * Envroment structure encode a list of relationships between names and values
+ *
+ * NOTE: bindings live in the parallel "syms"/"vals" arrays in definition
+ * order, "syms" holding interned names (see lval_intern). Once an
+ * environment grows past LENV_LINEAR_MAX bindings it also keeps an open
+ * addressing hash table ("index") that maps a symbol to its position in
+ * those arrays, so lookups in big environments (e.g. the global one) stop
+ * scanning every binding. Small environments keep the plain scan, which is
+ * cheaper than hashing for a handful of names.
+ */
+#define LENV_LINEAR_MAX 8
+
+struct lenv {
+  /* NOTE: parent environment pointer! A frame keeps its parent alive */
+  lenv *par;
+
+  /*
+   * The outermost environment of the "par" chain, and whether this is the
+   * environment of a lambda. Lookups of symbols that were never bound in a
+   * lambda's environment go straight to "top" (see LSYM_LOCAL), so they do
+   * not walk a chain of frames built up by deep (tail) recursion.
+   */
+  lenv *top;
+  int frame;
+
+  /* Owners of the environment, as for lval */
+  int refs;
+
+  int count;
+  int cap;
+  char **syms;
+  lval **vals;
+
+  /* Hash table of (binding position + 1), 0 marks an empty slot */
+  int mask;
+  int *index;
+};
+
+static lenv *lenv_new(void) {
+  lenv *env = lslab_alloc(sizeof(lenv));
+  env->par = NULL;
+  env->refs = 1;
+  env->top = env;
+  env->frame = 0;
+  env->count = 0;
+  env->cap = 0;
+  env->syms = NULL;
+  env->vals = NULL;
+  env->mask = 0;
+  env->index = NULL;
+  return env;
+}
+
+/* The environment of a lambda, which its arguments get bound in */
+static lenv *lenv_new_frame(void) {
+  lenv *env = lenv_new();
+  env->frame = 1;
+  return env;
+}
+
+static lenv *lenv_share(lenv *e) {
+  lref_inc(&e->refs);
+  return e;
+}
+
+static void lenv_del(lenv *e) {
+  /*
+   * NOTE: a loop rather than recursion, deep recursion leaves a long chain
+   * of frames behind that all go at once.
+   */
+  while (e && lref_dec(&e->refs) == 0) {
+    lenv *par = e->par;
+    for (int i = 0; i < e->count; i++) {
+      lval_del(e->vals[i]);
+    }
+    free(e->syms);
+    free(e->vals);
+    free(e->index);
+    lslab_free(e, sizeof(lenv));
+    e = par;
+  }
+}
+
+/* Symbols are interned, so hash the name's address (Fibonacci hashing) */
+static unsigned long lenv_hash(char *s) {
+  return ((unsigned long)s * 11400714819323198485UL) >> 32;
+}
+
+/* Rebuild the hash index with "size" slots (a power of two) */
+static void lenv_reindex(lenv *e, int size) {
+  free(e->index);
+  e->mask = size - 1;
+  e->index = calloc(size, sizeof(int));
+  for (int i = 0; i < e->count; i++) {
+    unsigned long h = lenv_hash(e->syms[i]) & e->mask;
+    while (e->index[h]) {
+      h = (h + 1) & e->mask;
+    }
+    e->index[h] = i + 1;
+  }
+}
+
+/* Position of interned "sym" in this environment only, -1 if not bound */
+static int lenv_find(lenv *e, char *sym) {
+  if (!e->index) {
+    for (int i = 0; i < e->count; i++) {
+      if (e->syms[i] == sym) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  unsigned long h = lenv_hash(sym) & e->mask;
+  while (e->index[h]) {
+    int i = e->index[h] - 1;
+    if (e->syms[i] == sym) {
+      return i;
+    }
+    h = (h + 1) & e->mask;
+  }
+  return -1;
+}
+
+static lval *lenv_get(lenv *e, lval *k) {
+  if (lval_type(k) == LVAL_SYM) {
+    if (!lsym_is_local(k->sym)) {
+      e = e->top;
+    }
+
+    /*
+     * NOTE: if we cannot find the symbol in the current environment, get it
+     * from parent's!
+     */
+    for (; e; e = e->par) {
+      int i = lenv_find(e, k->sym);
+      if (i >= 0) {
+        return lval_share(e->vals[i]);
+      }
+    }
+  }
+  return lval_err("unbound symbol!");
+}
+
+/* Bind interned "sym" to "v" in this environment */
+static void lenv_set(lenv *e, char *sym, lval *v) {
+  if (e->frame) {
+    lsym_set_local(sym);
+  }
+  int i = lenv_find(e, sym);
+  if (i >= 0) {
+    lval_del(e->vals[i]);
+    e->vals[i] = lval_share(v);
+    return;
+  }
+
+  /* NOTE: grow geometrically so a long run of 'def's is not quadratic */
+  if (e->count == e->cap) {
+    e->cap = e->cap ? e->cap * 2 : 4;
+    e->vals = realloc(e->vals, sizeof(lval *) * e->cap);
+    e->syms = realloc(e->syms, sizeof(char *) * e->cap);
+  }
+  e->count++;
+  e->vals[e->count - 1] = lval_share(v);
+  e->syms[e->count - 1] = sym;
+
+  /* Keep the hash index at most half full */
+  if (e->index && e->count * 2 <= e->mask + 1) {
+    unsigned long h = lenv_hash(sym) & e->mask;
+    while (e->index[h]) {
+      h = (h + 1) & e->mask;
+    }
+    e->index[h] = e->count;
+  } else if (e->count > LENV_LINEAR_MAX) {
+    int size = 32;
+    while (size < e->count * 2) {
+      size *= 2;
+    }
+    lenv_reindex(e, size);
+  }
+}
+
+static void lenv_put(lenv *e, lval *k, lval *v) {
+  if (lval_type(k) == LVAL_SYM) {
+    lenv_set(e, k->sym, v);
+  }
+}
+
+/* The value bound at position "i" of this environment, see LOP_LOCAL */
+static lval *lenv_slot(lenv *e, int i) { return e->vals[i]; }
+
+/*
+ * Unlike lenv_put, this function define the val in the global env.
+ */
+static void lenv_def(lenv *e, lval *k, lval *v) {
+  lenv_put(e->top, k, v);
+}
+
+static void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
+  lval *k = lval_sym(name);
+  lval *v = lval_fun(func);
+  lenv_put(e, k, v);
+  lval_del(k);
+  lval_del(v);
+}
+
+#define LASSERT(args, cond, err)                                               \
+  if (!(cond)) {                                                               \
+    lval_del(args);                                                            \
+    return lval_err(err);                                                      \
+  }
+
+/*
+ * A pending tail call
+ *
+ * When the last thing an expression does is evaluate another expression (a
+ * lambda body, the argument of 'eval' or the only element of "(...)"),
+ * lval_eval_sexpr, lval_call and lvm_run do not evaluate it themselves. They
+ * fill this in and return NULL, and lval_resume loops around to evaluate
+ * "expr" (or run "code" if it is set) in "env", so a chain of tail calls runs
+ * in constant C stack.
+ *
+ * NOTE: when a lambda is called "frame" is set to the new frame it runs in
+ * (the same as "env"), and "frame" and "code" each carry a reference that
+ * lval_resume holds on to until the body is done.
+ */
+typedef struct {
+  lenv *env;
+  lval *expr;
+  lcode *code;
+  lenv *frame;
+} ltail;
+
+static lval *lval_eval_sexpr(lenv *e, lval *v, ltail *t);
+static lval *lvm_run(lenv *e, lcode *c, ltail *t);
+
+/* Carry out a pending tail call, and any tail calls it makes in turn */
+static lval *lval_resume(ltail *t) {
+  /*
+   * The frame and code of the lambda being run. A tail call replaces them,
+   * the new frame keeps its parent (the old frame) alive if need be.
+   */
+  lenv *frame = NULL;
+  lcode *code = NULL;
+
+  lval *x = NULL;
+  while (!x) {
+    if (t->frame) {
+      if (frame) {
+        lenv_del(frame);
+        lcode_del(code);
+      }
+      frame = t->frame;
+      code = t->code;
+      t->frame = NULL;
+    }
+
+    if (t->code) {
+      x = lvm_run(t->env, t->code, t);
+      continue;
+    }
+    lval *v = t->expr;
+    switch (lval_type(v)) {
+    case LVAL_SYM:
+      x = lenv_get(t->env, v);
+      lval_del(v);
+      break;
+    case LVAL_SEXPR:
+      /* NOTE: evaluation rewrites the cells in place, so it needs a copy */
+      x = lval_eval_sexpr(t->env, lval_own(v), t);
+      break;
+    default:
+      /* All other lval types remain the same */
+      x = v;
+      break;
+    }
+  }
+
+  if (frame) {
+    lenv_del(frame);
+    lcode_del(code);
+  }
+  return x;
+}
+
+static lval *lval_eval(lenv *e, lval *v) {
+  ltail t = {e, v, NULL, NULL};
+  return lval_resume(&t);
+}
+
+/*
+ * NOTE: lval_pop mutates "v", so the caller must own it (see lval_own). The
+ * popped value may still be shared with somebody else.
+ */
+static lval *lval_pop(lval *v, size_t to_pop) {
+  lval *res = v->cell[to_pop];
+  if (to_pop == 0) {
+    /* NOTE: popping the front only moves the start of the list */
+    v->cell++;
+  } else {
+    memmove(&v->cell[to_pop], &v->cell[to_pop + 1],
+            sizeof(lval *) * (v->count - to_pop - 1));
+  }
+
+  v->count--;
+
+  /* NOTE: the storage is kept for reuse, it goes when the list is freed */
+  if (v->count == 0) {
+    v->cell = v->base;
+  }
+  return res;
+}
+
+static lval *lval_take(lval *v, size_t to_move) {
+  /* NOTE: not the most efficient */
+  lval *res = lval_pop(v, to_move);
+  lval_del(v);
+  return res;
+}
+
+static lval *lval_eval_arg(lval *a);
+static lval *lval_join(lval *x, lval *y);
+
+/*
+ * Call the function with a list of arguments
+ * NOTE: Here we allow currying!
+ *
+ * A lambda that gets all its arguments, and 'eval', do not evaluate their
+ * body here: it is handed back to lval_eval through "t" (see ltail).
+ */
+static lval *lval_call(lenv *e, lval *f, lval *a, ltail *t) {
+  if (f->builtin == builtin_eval) {
+    t->env = e;
+    t->expr = lval_eval_arg(a);
+    t->code = NULL;
+    t->frame = NULL;
+    lval_del(f);
+    return NULL;
+  }
+  if (f->builtin) {
+    lval *res = f->builtin(e, a);
+    lval_del(f);
+    return res;
+  }
+
+  /* The arguments of a partial application go before the new ones */
+  if (f->fn) {
+    lval *fn = lval_share(f->fn);
+    a = lval_join(lval_share(f->args), a);
+    lval_del(f);
+    f = fn;
+    /* NOTE: the arguments get popped below, which needs cells of their own */
+    a = lval_own(a);
+  }
+
+  lval *formals = f->formals;
+  char *amp = lcur->amp;
+
+  /* Until every formal before '&' has a value, just remember the arguments */
+  int i = 0;
+  while (i < formals->count && formals->cell[i]->sym != amp) {
+    i++;
+  }
+  if (a->count < i) {
+    lval *g = lval_alloc(LVAL_FUN);
+    g->builtin = NULL;
+    g->formals = NULL;
+    g->body = NULL;
+    g->code = NULL;
+    g->fn = f;
+    g->args = a;
+    return g;
+  }
+
+  /* NOTE: bound in a new frame, so "f" itself is left as it is */
+  lenv *frame = lenv_new_frame();
+  i = 0;
+
+  while (a->count) {
+    if (i == formals->count) {
+      lenv_del(frame);
+      lval_del(f);
+      lval_del(a);
+      return lval_err("Function passed too many arguments.");
+    }
+
+    char *sym = formals->cell[i++]->sym;
+    if (sym == amp) {
+      if (i != formals->count - 1) {
+        lenv_del(frame);
+        lval_del(f);
+        lval_del(a);
+        return lval_err("Function format invalid");
+      }
+
+      /* Next formal should be bound to remaining arguments */
+      a = builtin_list(e, a);
+      lenv_set(frame, formals->cell[i++]->sym, a);
+      break;
+    }
+
+    lval *val = lval_pop(a, 0);
+    lenv_set(frame, sym, val);
+    lval_del(val);
+  }
+
+  /* Argument list is now bound so can be cleaned up */
+  lval_del(a);
+
+  /* If '&' remains in formal list bind to empty list */
+  if (i < formals->count && formals->cell[i]->sym == amp) {
+    if (formals->count - i != 2) {
+      lenv_del(frame);
+      lval_del(f);
+      return lval_err("Function format invalid.");
+    }
+
+    lval *val = lval_qexpr();
+    lenv_set(frame, formals->cell[i + 1]->sym, val);
+    lval_del(val);
+    i += 2;
+  }
+
+  frame->par = lenv_share(e);
+  frame->top = e->top;
+  t->env = frame;
+  t->expr = NULL;
+  t->code = lcode_share(f->code);
+  t->frame = frame;
+  lval_del(f);
+  return NULL;
+}
+
+/*
+ * Vector kernels
+ *
+ * A Q-Expression of numbers such as {1 2 3 ...} is already a packed vector:
+ * numbers that fit are fixnums, so its cell array is a plain array of tagged
+ * 64 bit words with nothing behind them (see lval_num). When an operator gets
+ * at least LVEC_MIN arguments it first runs lvec_range over that array, which
+ * tells whether every argument is a fixnum, and if so their smallest and
+ * largest value. That answers 'min' and 'max' outright, and lets '+' prove
+ * the sum cannot overflow before adding the words up with lvec_sum. Anything
+ * else (big numbers, wrong types, possible overflow) goes through the scalar
+ * loop of the operator.
+ *
+ * Both come in an AVX2 version and a portable one the compiler is free to
+ * vectorize with SSE2.
+ *
+ * NOTE: a fixnum is 2x + 1, which orders like x, and summing n of them gives
+ * 2 * sum + n.
+ */
+#define LVEC_MIN 32
+
+static inline int lvec_avx2(void) {
+#ifdef LVEC_X86
+  return __builtin_cpu_supports("avx2");
+#else
+  return 0;
+#endif
+}
+
+/* Fold cell[i..n) into the tagged "and", "lo" and "hi" accumulators */
+static inline void lvec_range_tail(lval **cell, int i, int n, long *and,
+                                   long *lo, long *hi) {
+  for (; i < n; i++) {
+    long w = (long)cell[i];
+    *and &= w;
+    *lo = w < *lo ? w : *lo;
+    *hi = w > *hi ? w : *hi;
+  }
+}
+
+#ifdef LVEC_X86
+__attribute__((target("avx2"))) static void
+lvec_range_avx2(lval **cell, int n, long *and, long *lo, long *hi) {
+  __m256i va = _mm256_set1_epi64x(-1);
+  __m256i vl = _mm256_set1_epi64x(LONG_MAX);
+  __m256i vh = _mm256_set1_epi64x(LONG_MIN);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i w = _mm256_loadu_si256((__m256i *)&cell[i]);
+    va = _mm256_and_si256(va, w);
+    vl = _mm256_blendv_epi8(vl, w, _mm256_cmpgt_epi64(vl, w));
+    vh = _mm256_blendv_epi8(vh, w, _mm256_cmpgt_epi64(w, vh));
+  }
+
+  long la[4], ll[4], lh[4];
+  _mm256_storeu_si256((__m256i *)la, va);
+  _mm256_storeu_si256((__m256i *)ll, vl);
+  _mm256_storeu_si256((__m256i *)lh, vh);
+  for (int k = 0; k < 4; k++) {
+    *and &= la[k];
+    *lo = ll[k] < *lo ? ll[k] : *lo;
+    *hi = lh[k] > *hi ? lh[k] : *hi;
+  }
+  lvec_range_tail(cell, i, n, and, lo, hi);
+}
+
+__attribute__((target("avx2"))) static unsigned long
+lvec_sum_avx2(lval **cell, int n) {
+  __m256i s0 = _mm256_setzero_si256();
+  __m256i s1 = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    s0 = _mm256_add_epi64(s0, _mm256_loadu_si256((__m256i *)&cell[i]));
+    s1 = _mm256_add_epi64(s1, _mm256_loadu_si256((__m256i *)&cell[i + 4]));
+  }
+
+  unsigned long l[4];
+  _mm256_storeu_si256((__m256i *)l, _mm256_add_epi64(s0, s1));
+  unsigned long sum = l[0] + l[1] + l[2] + l[3];
+  for (; i < n; i++) {
+    sum += (unsigned long)cell[i];
+  }
+  return sum;
+}
+#endif
+
+/*
+ * Whether cell[0..n) are all fixnums, and if so their smallest and largest
+ * value in "lo" and "hi"
+ */
+static int lvec_range(lval **cell, int n, long *lo, long *hi) {
+  long and = -1;
+  long l = LONG_MAX;
+  long h = LONG_MIN;
+#ifdef LVEC_X86
+  if (lvec_avx2()) {
+    lvec_range_avx2(cell, n, &and, &l, &h);
+  } else
+#endif
+  {
+    lvec_range_tail(cell, 0, n, &and, &l, &h);
+  }
+
+  if (!(and & 1)) {
+    return 0;
+  }
+  *lo = lval_long((lval *)l);
+  *hi = lval_long((lval *)h);
+  return 1;
+}
+
+/*
+ * The sum of the fixnums cell[0..n), whose values all lie in [lo, hi]. Returns
+ * 0 without adding anything up if the sum might not fit in a fixnum.
+ */
+static int lvec_sum(lval **cell, int n, long lo, long hi, long *sum) {
+  long m = -lo > hi ? -lo : hi;
+  if (m != 0 && n > LVAL_FIXNUM_MAX / m) {
+    return 0;
+  }
+
+  /* NOTE: unsigned, so the words wrap around instead of overflowing */
+  unsigned long words = 0;
+#ifdef LVEC_X86
+  if (lvec_avx2()) {
+    words = lvec_sum_avx2(cell, n);
+  } else
+#endif
+  {
+    for (int i = 0; i < n; i++) {
+      words += (unsigned long)cell[i];
+    }
+  }
+  *sum = (long)(words - n) / 2;
+  return 1;
+}
+
+/*
+ * Arithmetic
+ *
+ * Each operator has its own kernel, which checks the type of every argument
+ * and folds it into a plain long in one pass over "a->cell". "+", "-" and "*"
+ * use the compiler's overflow checking builtins, so a result that does not fit
+ * in a long is an error rather than undefined behaviour.
+ *
+ * NOTE: a builtin is only called with at least one argument (see lval_apply).
+ */
+#define LASSERT_NUM(args, v)                                                   \
+  LASSERT(args, lval_type(v) == LVAL_NUM, "Cannot operate on non-number!")
+
+#define LASSERT_FITS(args, overflow)                                           \
+  LASSERT(args, !(overflow), "Integer overflow!")
+
+static lval *builtin_add(lenv *e, lval *a) {
+  long lo, hi, sum;
+  if (a->count >= LVEC_MIN && lvec_range(a->cell, a->count, &lo, &hi) &&
+      lvec_sum(a->cell, a->count, lo, hi, &sum)) {
+    lval_del(a);
+    return lval_num(sum);
+  }
+
+  LASSERT_NUM(a, a->cell[0]);
+  long x = lval_long(a->cell[0]);
+  for (int i = 1; i < a->count; i++) {
+    LASSERT_NUM(a, a->cell[i]);
+    LASSERT_FITS(a, __builtin_add_overflow(x, lval_long(a->cell[i]), &x));
+  }
+  lval_del(a);
+  return lval_num(x);
+}
+
+static lval *builtin_sub(lenv *e, lval *a) {
+  LASSERT_NUM(a, a->cell[0]);
+  long x = lval_long(a->cell[0]);
+
+  /* If no arguments and sub then perform unary negation */
+  if (a->count == 1) {
+    LASSERT_FITS(a, __builtin_sub_overflow(0, x, &x));
+  }
+
+  for (int i = 1; i < a->count; i++) {
+    LASSERT_NUM(a, a->cell[i]);
+    LASSERT_FITS(a, __builtin_sub_overflow(x, lval_long(a->cell[i]), &x));
+  }
+  lval_del(a);
+  return lval_num(x);
+}
+
+static lval *builtin_mul(lenv *e, lval *a) {
+  LASSERT_NUM(a, a->cell[0]);
+  long x = lval_long(a->cell[0]);
+  for (int i = 1; i < a->count; i++) {
+    LASSERT_NUM(a, a->cell[i]);
+    LASSERT_FITS(a, __builtin_mul_overflow(x, lval_long(a->cell[i]), &x));
+  }
+  lval_del(a);
+  return lval_num(x);
+}
+
+static lval *builtin_div(lenv *e, lval *a) {
+  LASSERT_NUM(a, a->cell[0]);
+  long x = lval_long(a->cell[0]);
+  for (int i = 1; i < a->count; i++) {
+    LASSERT_NUM(a, a->cell[i]);
+    long y = lval_long(a->cell[i]);
+    LASSERT(a, y != 0, "Division By Zero!");
+    LASSERT_FITS(a, x == LONG_MIN && y == -1);
+    x /= y;
+  }
+  lval_del(a);
+  return lval_num(x);
+}
+
+static lval *builtin_min(lenv *e, lval *a) {
+  long lo, hi;
+  if (a->count >= LVEC_MIN && lvec_range(a->cell, a->count, &lo, &hi)) {
+    lval_del(a);
+    return lval_num(lo);
+  }
+
+  LASSERT_NUM(a, a->cell[0]);
+  long x = lval_long(a->cell[0]);
+  for (int i = 1; i < a->count; i++) {
+    LASSERT_NUM(a, a->cell[i]);
+    long y = lval_long(a->cell[i]);
+    x = x < y ? x : y;
+  }
+  lval_del(a);
+  return lval_num(x);
+}
+
+static lval *builtin_max(lenv *e, lval *a) {
+  long lo, hi;
+  if (a->count >= LVEC_MIN && lvec_range(a->cell, a->count, &lo, &hi)) {
+    lval_del(a);
+    return lval_num(hi);
+  }
+
+  LASSERT_NUM(a, a->cell[0]);
+  long x = lval_long(a->cell[0]);
+  for (int i = 1; i < a->count; i++) {
+    LASSERT_NUM(a, a->cell[i]);
+    long y = lval_long(a->cell[i]);
+    x = x < y ? y : x;
+  }
+  lval_del(a);
+  return lval_num(x);
+}
+
+/*
+ * Lazy sequences
+ *
+ * A sequence does not hold its elements, it only knows how to produce the
+ * next one. Going through 'range' or 'iterate' with 'foldl', 'head' or 'tail'
+ * therefore takes constant memory however long the sequence is, as long as
+ * nothing holds on to the elements already seen. What the fields of a
+ * sequence mean depends on its kind:
+ *
+ *   LSEQ_RANGE    "at", "at" + "step", ... up to but excluding "end"
+ *   LSEQ_ITERATE  "src", ("gen" "src"), ("gen" ("gen" "src")), ...; "at" is
+ *                 set once "gen" is due to be called on "src"
+ *   LSEQ_TAKE     the first "at" elements of the sequence "src"
+ *   LSEQ_LIST     the elements of the Q-Expression "src" from index "at" on
+ *   LSEQ_CONCAT   the elements of each sequence in the Q-Expression "src"
+ *   LSEQ_MAP      ("gen" x) for each element x of the sequence "src"
+ *   LSEQ_FILTER   the elements x of the sequence "src" for which ("gen" x)
+ *                 holds (see lval_test)
+ *
+ * NOTE: like every other value a sequence does not change once it is shared,
+ * stepping a shared one steps a copy of it (see lval_own). The function of
+ * 'iterate' is called in the environment of whoever steps the sequence, as a
+ * call written there would be; the sequence itself never refers to an
+ * environment.
+ */
+enum {
+  LSEQ_RANGE,
+  LSEQ_ITERATE,
+  LSEQ_TAKE,
+  LSEQ_LIST,
+  LSEQ_CONCAT,
+  LSEQ_MAP,
+  LSEQ_FILTER
+};
+
+static lval *lval_seq(int kind, lval *src) {
+  lval *v = lval_alloc(LVAL_SEQ);
+  v->kind = kind;
+  v->at = 0;
+  v->end = 0;
+  v->step = 0;
+  v->src = src;
+  v->gen = NULL;
+  return v;
+}
+
+/* Call "f" with the arguments "a", running the call to its result */
+static lval *lval_call_now(lenv *e, lval *f, lval *a) {
+  ltail t;
+  lval *x = lval_call(e, f, a, &t);
+  return x ? x : lval_resume(&t);
+}
+
+/*
+ * Whether the predicate "p" holds for "x" (consumed), that is gives a number
+ * other than 0. Returns 1 or 0, or -1 with the error in "err" if the call
+ * fails or does not give a number.
+ */
+static int lval_test(lenv *e, lval *p, lval *x, lval **err) {
+  lval *y = lval_call_now(e, lval_share(p), lval_add(lval_sexpr(), x));
+  if (lval_type(y) == LVAL_NUM) {
+    return lval_long(y) != 0;
+  }
+  if (lval_type(y) != LVAL_ERR) {
+    lval_del(y);
+    y = lval_err("Predicate did not return a number!");
+  }
+  *err = y;
+  return -1;
+}
+
+/*
+ * Step the sequence "s". Consumes "s" and returns the rest of it, with its
+ * first element in "x", or NULL once it is empty. "x" is then NULL too,
+ * unless producing the element failed, in which case it is the error.
+ */
+static lval *lseq_next(lenv *e, lval *s, lval **x) {
+  *x = NULL;
+  switch (s->kind) {
+  case LSEQ_RANGE:
+    if (s->step > 0 ? s->at >= s->end : s->at <= s->end) {
+      break;
+    }
+    s = lval_own(s);
+    *x = lval_num(s->at);
+    /* NOTE: past LONG_MAX (or LONG_MIN) is past "end" as well */
+    if (__builtin_add_overflow(s->at, s->step, &s->at)) {
+      s->at = s->end;
+    }
+    return s;
+
+  case LSEQ_ITERATE:
+    s = lval_own(s);
+    if (s->at) {
+      lval *y = lval_call_now(e, lval_share(s->gen),
+                              lval_add(lval_sexpr(), s->src));
+      s->src = NULL;
+      if (lval_type(y) == LVAL_ERR) {
+        *x = y;
+        break;
+      }
+      s->src = y;
+    }
+    s->at = 1;
+    *x = lval_share(s->src);
+    return s;
+
+  case LSEQ_TAKE:
+    if (s->at == 0) {
+      break;
+    }
+    s = lval_own(s);
+    s->src = lseq_next(e, s->src, x);
+    if (!s->src) {
+      break;
+    }
+    s->at--;
+    return s;
+
+  case LSEQ_LIST:
+    if (s->at == s->src->count) {
+      break;
+    }
+    s = lval_own(s);
+    *x = lval_share(s->src->cell[s->at++]);
+    return s;
+
+  case LSEQ_CONCAT:
+    s = lval_own(s);
+    s->src = lval_own(s->src);
+    while (s->src->count) {
+      lval *rest = lseq_next(e, s->src->cell[0], x);
+      if (rest) {
+        s->src->cell[0] = rest;
+        return s;
+      }
+      /* NOTE: the part itself was already consumed by lseq_next */
+      lval_pop(s->src, 0);
+      if (*x) {
+        break;
+      }
+    }
+    break;
+
+  case LSEQ_MAP:
+    s = lval_own(s);
+    s->src = lseq_next(e, s->src, x);
+    if (!s->src) {
+      break;
+    }
+    *x = lval_call_now(e, lval_share(s->gen), lval_add(lval_sexpr(), *x));
+    if (lval_type(*x) == LVAL_ERR) {
+      break;
+    }
+    return s;
+
+  case LSEQ_FILTER:
+    s = lval_own(s);
+    while ((s->src = lseq_next(e, s->src, x))) {
+      lval *err;
+      int keep = lval_test(e, s->gen, lval_share(*x), &err);
+      if (keep > 0) {
+        return s;
+      }
+      lval_del(*x);
+      *x = keep < 0 ? err : NULL;
+      if (*x) {
+        break;
+      }
+    }
+    break;
+  }
+
+  lval_del(s);
+  return NULL;
+}
+
+/* A Q-Expression as a sequence of its elements */
+static lval *lseq_list(lval *v) { return lval_seq(LSEQ_LIST, v); }
+
+/*
+ * The elements of the Q-Expressions and sequences in "a", one after the other,
+ * as a sequence
+ *
+ * NOTE: the parts of a joined sequence are taken over rather than the
+ * sequence itself, so joining onto the result again does not nest sequences
+ * any deeper, however often it is done.
+ */
+static lval *lseq_join(lval *a) {
+  lval *parts = lval_qexpr();
+  while (a->count) {
+    lval *v = lval_pop(a, 0);
+    if (lval_type(v) == LVAL_QEXPR && v->count == 0) {
+      lval_del(v);
+    } else if (lval_type(v) == LVAL_QEXPR) {
+      parts = lval_add(parts, lseq_list(v));
+    } else if (v->kind == LSEQ_CONCAT) {
+      parts = lval_join(parts, lval_share(v->src));
+      lval_del(v);
+    } else {
+      parts = lval_add(parts, v);
+    }
+  }
+  lval_del(a);
+  return lval_seq(LSEQ_CONCAT, parts);
+}
+
+/*
+ * Append every element of the sequence "s" to the Q-Expression "x", or return
+ * the error that stopped the sequence
+ */
+static lval *lseq_drain(lenv *e, lval *x, lval *s) {
+  lval *y;
+  while ((s = lseq_next(e, s, &y))) {
+    x = lval_add(x, y);
+  }
+  if (y) {
+    lval_del(x);
+    return y;
+  }
+  return x;
+}
+
+/*
+ * range end / range start end / range start end step
+ *
+ * The sequence of numbers from "start" (0 by default) up to but excluding
+ * "end", "step" (1 by default) apart.
+ */
+static lval *builtin_range(lenv *e, lval *a) {
+  LASSERT(a, a->count <= 3, "Function 'range' passed too many arguments!");
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_NUM(a, a->cell[i]);
+  }
+  long start = 0;
+  long end = lval_long(a->cell[0]);
+  long step = 1;
+  if (a->count > 1) {
+    start = end;
+    end = lval_long(a->cell[1]);
+  }
+  if (a->count > 2) {
+    step = lval_long(a->cell[2]);
+  }
+  LASSERT(a, step != 0, "Function 'range' passed zero step!");
+  lval_del(a);
+
+  lval *s = lval_seq(LSEQ_RANGE, NULL);
+  s->at = start;
+  s->end = end;
+  s->step = step;
+  return s;
+}
+
+/* iterate f x: the endless sequence x, (f x), (f (f x)), ... */
+static lval *builtin_iterate(lenv *e, lval *a) {
+  LASSERT(a, a->count == 2,
+          "Function 'iterate' passed wrong number of arguments!");
+  LASSERT(a, lval_type(a->cell[0]) == LVAL_FUN,
+          "Function 'iterate' passed incorrect type!");
+  lval *f = lval_pop(a, 0);
+  lval *s = lval_seq(LSEQ_ITERATE, lval_take(a, 0));
+  s->gen = f;
+  return s;
+}
+
+/*
+ * take n s: the first "n" elements of "s", a sequence if "s" is one and a
+ * Q-Expression if it is one
+ */
+static lval *builtin_take(lenv *e, lval *a) {
+  LASSERT(a, a->count == 2,
+          "Function 'take' passed wrong number of arguments!");
+  LASSERT(a,
+          lval_type(a->cell[0]) == LVAL_NUM &&
+              (lval_type(a->cell[1]) == LVAL_QEXPR ||
+               lval_type(a->cell[1]) == LVAL_SEQ),
+          "Function 'take' passed incorrect type!");
+  long n = lval_long(a->cell[0]);
+  LASSERT(a, n >= 0, "Function 'take' passed negative count!");
+
+  lval *s = lval_take(a, 1);
+  if (lval_type(s) == LVAL_SEQ) {
+    s = lval_seq(LSEQ_TAKE, s);
+    s->at = n;
+    return s;
+  }
+  return s->count <= n ? s : lval_slice(s, 0, n);
+}
+
+/*
+ * foldl f z s: (f (... (f (f z x1) x2) ...) xn) over the elements x1 ... xn of
+ * the Q-Expression or sequence "s", stepping a sequence only as far as needed
+ */
+static lval *builtin_foldl(lenv *e, lval *a) {
+  LASSERT(a, a->count == 3,
+          "Function 'foldl' passed wrong number of arguments!");
+  LASSERT(a,
+          lval_type(a->cell[0]) == LVAL_FUN &&
+              (lval_type(a->cell[2]) == LVAL_QEXPR ||
+               lval_type(a->cell[2]) == LVAL_SEQ),
+          "Function 'foldl' passed incorrect type!");
+  lval *f = lval_pop(a, 0);
+  lval *acc = lval_pop(a, 0);
+  lval *s = lval_take(a, 0);
+  if (lval_type(s) == LVAL_QEXPR) {
+    s = lseq_list(s);
+  }
+
+  lval *x = NULL;
+  while (s && lval_type(acc) != LVAL_ERR) {
+    s = lseq_next(e, s, &x);
+    if (s) {
+      lval *args = lval_add(lval_add(lval_sexpr(), acc), x);
+      acc = lval_call_now(e, lval_share(f), args);
+      x = NULL;
+    }
+  }
+  if (s) {
+    lval_del(s);
+  }
+  if (x) {
+    lval_del(acc);
+    acc = x;
+  }
+  lval_del(f);
+  return acc;
+}
+
+/*
+ * map f l: the Q-Expression or sequence of (f x) for every element x of "l"
+ *
+ * NOTE: the results go straight into the cells of "l" when nothing else
+ * shares it, so no second list is allocated. A sequence is mapped lazily.
+ */
+static lval *builtin_map(lenv *e, lval *a) {
+  LASSERT(a, a->count == 2,
+          "Function 'map' passed wrong number of arguments!");
+  LASSERT(a,
+          lval_type(a->cell[0]) == LVAL_FUN &&
+              (lval_type(a->cell[1]) == LVAL_QEXPR ||
+               lval_type(a->cell[1]) == LVAL_SEQ),
+          "Function 'map' passed incorrect type!");
+  lval *f = lval_pop(a, 0);
+  lval *l = lval_take(a, 0);
+  if (lval_type(l) == LVAL_SEQ) {
+    l = lval_seq(LSEQ_MAP, l);
+    l->gen = f;
+    return l;
+  }
+
+  l = lval_own(l);
+  for (int i = 0; i < l->count; i++) {
+    lval *args = lval_add(lval_sexpr(), l->cell[i]);
+    lval *x = lval_call_now(e, lval_share(f), args);
+    l->cell[i] = x;
+    if (lval_type(x) == LVAL_ERR) {
+      x = lval_share(x);
+      lval_del(l);
+      lval_del(f);
+      return x;
+    }
+  }
+  lval_del(f);
+  return l;
+}
+
+/*
+ * filter p l: the elements x of the Q-Expression or sequence "l" for which
+ * (p x) holds, i.e. gives a number other than 0
+ *
+ * NOTE: as with 'map' the elements kept are moved down within "l" itself
+ * when nothing else shares it. A sequence is filtered lazily.
+ */
+static lval *builtin_filter(lenv *e, lval *a) {
+  LASSERT(a, a->count == 2,
+          "Function 'filter' passed wrong number of arguments!");
+  LASSERT(a,
+          lval_type(a->cell[0]) == LVAL_FUN &&
+              (lval_type(a->cell[1]) == LVAL_QEXPR ||
+               lval_type(a->cell[1]) == LVAL_SEQ),
+          "Function 'filter' passed incorrect type!");
+  lval *p = lval_pop(a, 0);
+  lval *l = lval_take(a, 0);
+  if (lval_type(l) == LVAL_SEQ) {
+    l = lval_seq(LSEQ_FILTER, l);
+    l->gen = p;
+    return l;
+  }
+
+  l = lval_own(l);
+  lval *err = NULL;
+  int j = 0;
+  for (int i = 0; i < l->count; i++) {
+    lval *x = l->cell[i];
+    int keep = err ? 1 : lval_test(e, p, lval_share(x), &err);
+    if (keep) {
+      /* NOTE: after an error the rest is kept as is, only to be freed */
+      l->cell[j++] = x;
+    } else {
+      lval_del(x);
+    }
+  }
+  l->count = j;
+  lval_del(p);
+  if (err) {
+    lval_del(l);
+    return err;
+  }
+  return l;
+}
+
+/* len l: the number of elements of a Q-Expression, or left in a sequence */
+static lval *builtin_len(lenv *e, lval *a) {
+  LASSERT(a, a->count == 1, "Function 'len' passed too many arguments!");
+  LASSERT(a,
+          lval_type(a->cell[0]) == LVAL_QEXPR ||
+              lval_type(a->cell[0]) == LVAL_SEQ,
+          "Function 'len' passed incorrect type!");
+  lval *l = lval_take(a, 0);
+  long n = 0;
+  if (lval_type(l) == LVAL_QEXPR) {
+    n = l->count;
+    lval_del(l);
+    return lval_num(n);
+  }
+
+  lval *x;
+  while ((l = lseq_next(e, l, &x))) {
+    lval_del(x);
+    n++;
+  }
+  return x ? x : lval_num(n);
+}
+
+/*
+ * Parallel map and reduce
+ *
+ * 'pmap' and 'preduce' cut a Q-Expression into chunks of LPAR_CHUNK elements
+ * and work on the chunks on all threads of a pool at once, the one that
+ * called them included. Every thread starts off with an equal range of the
+ * chunks; it takes chunks from the front of its own range, and once that is
+ * empty it steals the back half of the range of some other thread, so threads
+ * that get cheap chunks help the ones that get expensive ones.
+ *
+ * Each worker thread runs a lispy of its own (see struct lispy), so it
+ * allocates from pools only it uses, and the interpreter takes those pools
+ * over when all chunks are done (see lslab_adopt). Values, the environment
+ * 'pmap' was called in and everything above it are shared between the
+ * threads while they run, read only: reference counts change atomically
+ * (see lref_inc), 'def' fails, and so does '=' in the calling environment.
+ * The same goes when there is only one thread, so functions behave the same
+ * however many threads there are.
+ *
+ * NOTE: the pool is started the first time it is needed, with a thread per
+ * core, or as many threads as LISPY_THREADS says.
+ */
+#define LPAR_CHUNK 64
+
+typedef struct {
+  lenv *env;
+  lval *f;
+  lval **in;
+  long count;
+  /* The result for each element ('pmap') or each chunk ('preduce') */
+  lval **out;
+  int reduce;
+} ljob;
+
+/* Work on chunk "c" of "job" */
+static void ljob_run(ljob *job, long c) {
+  long lo = c * LPAR_CHUNK;
+  long hi = lo + LPAR_CHUNK < job->count ? lo + LPAR_CHUNK : job->count;
+  if (!job->reduce) {
+    for (long i = lo; i < hi; i++) {
+      lval *args = lval_add(lval_sexpr(), lval_share(job->in[i]));
+      job->out[i] = lval_call_now(job->env, lval_share(job->f), args);
+    }
+    return;
+  }
+
+  /* NOTE: a chunk is folded starting from its own first element */
+  lval *acc = lval_share(job->in[lo]);
+  for (long i = lo + 1; i < hi && lval_type(acc) != LVAL_ERR; i++) {
+    lval *args = lval_add(lval_add(lval_sexpr(), acc), lval_share(job->in[i]));
+    acc = lval_call_now(job->env, lval_share(job->f), args);
+  }
+  job->out[c] = acc;
+}
+
+#ifdef LPAR_THREADS
+typedef struct {
+  lispy shell;
+  lpar *par;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  /* The chunks [lo, hi) left to this thread */
+  long lo;
+  long hi;
+} lworker;
+
+struct lpar {
+  /* Threads, counting the one that calls 'pmap' as "workers[0]" */
+  int count;
+  lworker *workers;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  /* Bumped for each job, the number of workers still on it, and the job */
+  long round;
+  int busy;
+  int quit;
+  ljob *job;
+};
+
+/* The next chunk for worker "w" to work on, -1 once there are none left */
+static long lpar_next(lpar *p, lworker *w) {
+  pthread_mutex_lock(&w->lock);
+  long c = w->lo < w->hi ? w->lo++ : -1;
+  pthread_mutex_unlock(&w->lock);
+  if (c >= 0) {
+    return c;
+  }
+
+  for (int k = 1; k < p->count; k++) {
+    lworker *v = &p->workers[(w - p->workers + k) % p->count];
+    pthread_mutex_lock(&v->lock);
+    long hi = v->hi;
+    long lo = hi - (hi - v->lo + 1) / 2;
+    v->hi = lo;
+    pthread_mutex_unlock(&v->lock);
+    if (lo < hi) {
+      pthread_mutex_lock(&w->lock);
+      w->lo = lo + 1;
+      w->hi = hi;
+      pthread_mutex_unlock(&w->lock);
+      return lo;
+    }
+  }
+  return -1;
+}
+
+static void lpar_work(lpar *p, lworker *w) {
+  long c;
+  while ((c = lpar_next(p, w)) >= 0) {
+    ljob_run(p->job, c);
+  }
+}
+
+static void *lpar_main(void *arg) {
+  lworker *w = arg;
+  lpar *p = w->par;
+  long round = 0;
+
+  pthread_mutex_lock(&p->lock);
+  while (1) {
+    while (p->round == round && !p->quit) {
+      pthread_cond_wait(&p->wake, &p->lock);
+    }
+    if (p->quit) {
+      break;
+    }
+    round = p->round;
+    pthread_mutex_unlock(&p->lock);
+
+    lcur = &w->shell;
+    lparallel = 1;
+    lpar_work(p, w);
+    lcur = NULL;
+
+    pthread_mutex_lock(&p->lock);
+    if (--p->busy == 0) {
+      pthread_cond_signal(&p->done);
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+static lpar *lpar_new(lispy *l) {
+  char *env = getenv("LISPY_THREADS");
+  long n = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+  n = n < 1 ? 1 : n;
+
+  lpar *p = malloc(sizeof(lpar));
+  p->count = n;
+  p->workers = calloc(n, sizeof(lworker));
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->wake, NULL);
+  pthread_cond_init(&p->done, NULL);
+  p->round = 0;
+  p->busy = 0;
+  p->quit = 0;
+  p->job = NULL;
+
+  for (int i = 0; i < n; i++) {
+    lworker *w = &p->workers[i];
+    w->par = p;
+    pthread_mutex_init(&w->lock, NULL);
+    w->shell.root = l;
+    w->shell.amp = l->amp;
+    if (i > 0) {
+      pthread_create(&w->thread, NULL, lpar_main, w);
+    }
+  }
+  return p;
+}
+
+static void lpar_del(lpar *p) {
+  pthread_mutex_lock(&p->lock);
+  p->quit = 1;
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+  for (int i = 0; i < p->count; i++) {
+    if (i > 0) {
+      pthread_join(p->workers[i].thread, NULL);
+    }
+    pthread_mutex_destroy(&p->workers[i].lock);
+  }
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->wake);
+  pthread_cond_destroy(&p->done);
+  free(p->workers);
+  free(p);
+}
+#endif
+
+/*
+ * Work on all "chunks" chunks of "job", on the pool if there is more than one
+ * and this is not a job within a job already
+ *
+ * NOTE: the environment of the job is frozen either way, so what a function
+ * may do does not depend on how many threads there are.
+ */
+static void ljob_run_all(ljob *job, long chunks) {
+  lispy *l = lcur;
+  lenv *frozen = l->frozen;
+  l->frozen = job->env;
+#ifdef LPAR_THREADS
+  if (!l->par && !lparallel && chunks > 1) {
+    l->par = lpar_new(l);
+  }
+  lpar *p = l->par;
+  if (p && p->count > 1 && !lparallel && chunks > 1) {
+    for (int i = 0; i < p->count; i++) {
+      p->workers[i].lo = chunks * i / p->count;
+      p->workers[i].hi = chunks * (i + 1) / p->count;
+    }
+    p->job = job;
+    lparallel = 1;
+    for (int i = 1; i < p->count; i++) {
+      p->workers[i].shell.frozen = job->env;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->round++;
+    p->busy = p->count - 1;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    lpar_work(p, &p->workers[0]);
+
+    pthread_mutex_lock(&p->lock);
+    while (p->busy) {
+      pthread_cond_wait(&p->done, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    lparallel = 0;
+    for (int i = 1; i < p->count; i++) {
+      lslab_adopt(l, &p->workers[i].shell);
+    }
+    l->frozen = frozen;
+    return;
+  }
+#endif
+  for (long c = 0; c < chunks; c++) {
+    ljob_run(job, c);
+  }
+  l->frozen = frozen;
+}
+
+/*
+ * pmap f l: 'map' with the calls of "f" spread over all cores
+ *
+ * NOTE: each result goes where its element was, whichever thread worked it
+ * out, so the result is the same as that of 'map', down to which error is
+ * given if several calls fail: the first in the list.
+ */
+static lval *builtin_pmap(lenv *e, lval *a) {
+  LASSERT(a, a->count == 2,
+          "Function 'pmap' passed wrong number of arguments!");
+  LASSERT(a,
+          lval_type(a->cell[0]) == LVAL_FUN &&
+              lval_type(a->cell[1]) == LVAL_QEXPR,
+          "Function 'pmap' passed incorrect type!");
+
+  lval *f = lval_pop(a, 0);
+  lval *l = lval_take(a, 0);
+  long n = l->count;
+  lval **out = malloc(sizeof(lval *) * n);
+  ljob job = {e, f, l->cell, n, out, 0};
+  ljob_run_all(&job, (n + LPAR_CHUNK - 1) / LPAR_CHUNK);
+  lval_del(f);
+  lval_del(l);
+
+  lval *x = lval_qexpr();
+  lval_reserve(x, n);
+  memcpy(x->cell, out, sizeof(lval *) * n);
+  x->count = n;
+  free(out);
+  for (long i = 0; i < n; i++) {
+    if (lval_type(x->cell[i]) == LVAL_ERR) {
+      lval *err = lval_share(x->cell[i]);
+      lval_del(x);
+      return err;
+    }
+  }
+  return x;
+}
+
+/*
+ * preduce f z l: 'foldl' over a Q-Expression for an associative "f", with the
+ * chunks of "l" folded on all cores
+ *
+ * NOTE: every chunk is folded on its own, then "z" and the results of the
+ * chunks are folded in order. Chunks are always LPAR_CHUNK elements, however
+ * many threads there are and whichever does what, so the result only depends
+ * on "l"; for an associative "f" it is that of 'foldl'. A list of up to
+ * LPAR_CHUNK elements is a single chunk, folded on the calling thread.
+ */
+static lval *builtin_preduce(lenv *e, lval *a) {
+  LASSERT(a, a->count == 3,
+          "Function 'preduce' passed wrong number of arguments!");
+  LASSERT(a,
+          lval_type(a->cell[0]) == LVAL_FUN &&
+              lval_type(a->cell[2]) == LVAL_QEXPR,
+          "Function 'preduce' passed incorrect type!");
+
+  lval *f = lval_pop(a, 0);
+  lval *acc = lval_pop(a, 0);
+  lval *l = lval_take(a, 0);
+  long n = l->count;
+  long chunks = (n + LPAR_CHUNK - 1) / LPAR_CHUNK;
+  lval **out = malloc(sizeof(lval *) * chunks);
+  ljob job = {e, f, l->cell, n, out, 1};
+  ljob_run_all(&job, chunks);
+  lval_del(l);
+
+  for (long c = 0; c < chunks; c++) {
+    if (lval_type(acc) == LVAL_ERR) {
+      lval_del(out[c]);
+    } else if (lval_type(out[c]) == LVAL_ERR) {
+      lval_del(acc);
+      acc = out[c];
+    } else {
+      lval *args = lval_add(lval_add(lval_sexpr(), acc), out[c]);
+      acc = lval_call_now(e, lval_share(f), args);
+    }
+  }
+  free(out);
+  lval_del(f);
+  return acc;
+}
+
+/* Support Q-Expression:
+ * lispy> list 1 2 3 4
+ * {1 2 3 4}
+ * lispy> head (list 1 2 3 4)
+ * {1}
+ * lispy> eval {head (list 1 2 3 4)}
+ * {1}
+ * lispy> eval head (list 1 2 3 4)
+ * 1
+ * lispy> tail {tail tail tail}
+ * {tail tail}
+ * lispy> eval (tail {tail tail {5 6 7}})
+ * {6 7}
+ * lispy> eval (head {(+ 1 2) (+ 10 20)})
+ * 3
+ */
+/*
+ * Takes a Q-Expression and returns a Q-Expression with only of the first
+ * element
+ *
+ * NOTE: a sequence is stepped once, giving a Q-Expression as well
+ */
+static lval *builtin_head(lenv *e, lval *a) {
+  LASSERT(a, a->count == 1, "Function 'head' passed too many arguments!");
+  if (lval_type(a->cell[0]) == LVAL_SEQ) {
+    lval *x;
+    lval *rest = lseq_next(e, lval_take(a, 0), &x);
+    if (!rest) {
+      return x ? x : lval_err("Function 'head' passed {}!");
+    }
+    lval_del(rest);
+    return lval_add(lval_qexpr(), x);
+  }
+  LASSERT(a, lval_type(a->cell[0]) == LVAL_QEXPR,
+          "Function 'head' passed incorrect type!");
+  LASSERT(a, a->cell[0]->count != 0, "Function 'head' passed {}!");
+
+  return lval_slice(lval_take(a, 0), 0, 1);
+}
+
+/*
+ * Takes a Q-Expression and returns a Q-Expression with the first element
+ * removed
+ *
+ * NOTE: the tail of a sequence is the rest of the sequence
+ */
+static lval *builtin_tail(lenv *e, lval *a) {
+  LASSERT(a, a->count == 1, "Function 'tail' passed too many arguments!");
+  if (lval_type(a->cell[0]) == LVAL_SEQ) {
+    lval *x;
+    lval *rest = lseq_next(e, lval_take(a, 0), &x);
+    if (!rest) {
+      return x ? x : lval_err("Function 'tail' passed {}!");
+    }
+    lval_del(x);
+    return rest;
+  }
+  LASSERT(a, lval_type(a->cell[0]) == LVAL_QEXPR,
+          "Function 'tail' passed incorrect type!");
+  LASSERT(a, a->cell[0]->count != 0, "Function 'tail' passed {}!");
+
+  if (a->cell[0]->count == 0) {
+    lval_del(a);
+    return lval_err("Function 'tail' passed {}!");
+  }
+
+  /* Take first argument */
+  lval *v = lval_take(a, 0);
+  return lval_slice(v, 1, v->count - 1);
+}
+
+/*
+ * Takes one or more arguments and returns a new Q-Expression containing the
+ * arguments
+ */
+static lval *builtin_list(lenv *e, lval *a) {
+  a->type = LVAL_QEXPR;
+  return a;
+}
+
+/*
+ * Check the arguments of 'eval' and turn its Q-Expression into the
+ * S-Expression to evaluate (or an error, which evaluates to itself)
+ */
+static lval *lval_eval_arg(lval *a) {
+  LASSERT(a, a->count == 1, "Function 'eval' passed too many arguments!");
+  LASSERT(a, lval_type(a->cell[0]) == LVAL_QEXPR,
+          "Function 'eval' passed incorrect type!");
+  lval *x = lval_own(lval_take(a, 0));
+  x->type = LVAL_SEXPR;
+  return x;
+}
+
+/*
+ * Takes a Q-Expression and evaluates it as if it were a S-Expression
+ * NOTE: calls through lval_call are turned into tail calls instead
+ */
+static lval *builtin_eval(lenv *e, lval *a) {
+  return lval_eval(e, lval_eval_arg(a));
+}
+
+static lval *lval_join(lval *x, lval *y) {
+  /*
+   * NOTE: if "x" is shared but ends where the elements of its storage do and
+   * there is room after them, "y" goes there and "x" becomes a view that
+   * shows it as well. The other views do not show past their own end, so
+   * they do not change, and joining onto a shared list is O(y) rather than
+   * O(x + y) (see lcells).
+   *
+   * NOTE: not while 'pmap' runs, when other threads may be reading the
+   * storage.
+   */
+  int shared = lref_get(&x->refs) > 1;
+  if (!lparallel && !lval_inline(x) &&
+      (shared || lval_cells_shared(x))) {
+    lcells *b = lcells_of(x);
+    int end = x->cell - b->cells + x->count;
+    if ((!b->shared || end == b->hi) && end + y->count <= x->cap) {
+      if (shared) {
+        x = lval_view(x);
+      }
+      for (int i = 0; i < y->count; i++) {
+        b->cells[end + i] = lval_share(y->cell[i]);
+      }
+      b->hi = end + y->count;
+      x->count += y->count;
+      lval_del(y);
+      return x;
+    }
+  }
+
+  x = lval_own(x);
+  lval_reserve(x, x->count + y->count);
+  if (lref_get(&y->refs) == 1 && !lval_cells_shared(y)) {
+    /* Nobody else sees "y", so move its cells over in one go */
+    memcpy(&x->cell[x->count], y->cell, sizeof(lval *) * y->count);
+    x->count += y->count;
+    y->count = 0;
+  } else {
+    /* NOTE: "y" is shared, so share its elements instead of moving them */
+    for (int i = 0; i < y->count; i++) {
+      x->cell[x->count++] = lval_share(y->cell[i]);
+    }
+  }
+  lval_del(y);
+  return x;
+}
+
+/*
+ * Takes one or more Q-Expressions and returns a Q-Expression of them conjoined
+ * together
+ *
+ * NOTE: sequences can be joined as well. Starting with a sequence gives a
+ * sequence that goes through the others in turn when stepped, starting with a
+ * Q-Expression reads any sequence after it into the result, so e.g.
+ * "join {} (range 5)" is {0 1 2 3 4}.
+ */
+static lval *builtin_join(lenv *e, lval *a) {
+  for (int i = 0; i < a->count; i++) {
+    LASSERT(a,
+            lval_type(a->cell[i]) == LVAL_QEXPR ||
+                lval_type(a->cell[i]) == LVAL_SEQ,
+            "Function 'join' passed incorrect type.");
+  }
+  if (lval_type(a->cell[0]) == LVAL_SEQ) {
+    return lseq_join(a);
+  }
+  lval *x = lval_pop(a, 0);
+  while (a->count) {
+    lval *y = lval_pop(a, 0);
+    x = lval_type(y) == LVAL_SEQ ? lseq_drain(e, x, y) : lval_join(x, y);
+    if (lval_type(x) == LVAL_ERR) {
+      break;
+    }
+  }
+  lval_del(a);
+  return x;
+}
+
+static lval *builtin_var(lenv *e, lval *a, char *func) {
+  LASSERT(a, lval_type(a->cell[0]) == LVAL_QEXPR,
+          "Function 'def' passed incorrect type!");
+
+  lval *syms = a->cell[0];
+  for (int i = 0; i < syms->count; i++) {
+    LASSERT(a, lval_type(syms->cell[i]) == LVAL_SYM,
+            "Function 'def' cannot define non-symbol");
+  }
+  /* Check correct number of symbols and values */
+  LASSERT(a, syms->count == a->count - 1,
+          "Function 'def' cannot define incorrect number of values to symbols");
+  /* If 'def' define in globally. If 'put' define in locally */
+  int global = strcmp(func, "def") == 0;
+  /* NOTE: other threads may be reading these environments (see lpar) */
+  LASSERT(a, !lcur->frozen || (!global && e != lcur->frozen),
+          "Cannot define in a shared environment while running in parallel");
+  for (int i = 0; i < syms->count; i++) {
+    if (global) {
+      lenv_def(e, syms->cell[i], a->cell[i + 1]);
+    } else {
+      lenv_put(e, syms->cell[i], a->cell[i + 1]);
+    }
+  }
+  lval_del(a);
+  return lval_sexpr();
+}
+
+static lval *builtin_put(lenv *e, lval *a) { return builtin_var(e, a, "="); }
+
+static lval *builtin_def(lenv *e, lval *a) { return builtin_var(e, a, "def"); }
+
+static lval *lenv_load(lenv *e, const char *path, FILE *out, int *failed);
+
+static lval *builtin_load(lenv *e, lval *a) {
+  LASSERT(a, a->count == 1, "Function 'load' passed too many arguments!");
+  LASSERT(a, lval_type(a->cell[0]) == LVAL_STR,
+          "Function 'load' passed incorrect type!");
+  lval *x = lenv_load(e, a->cell[0]->str, stdout, NULL);
+  lval_del(a);
+  return x;
+}
+
+static lval *lenv_save_image(lenv *e, const char *path);
+
+static lval *builtin_save_image(lenv *e, lval *a) {
+  LASSERT(a, a->count == 1, "Function 'save-image' passed too many arguments!");
+  LASSERT(a, lval_type(a->cell[0]) == LVAL_STR,
+          "Function 'save-image' passed incorrect type!");
+  lval *x = lenv_save_image(e, a->cell[0]->str);
+  lval_del(a);
+  return x;
+}
+
+static lval *builtin_print(lenv *e, lval *a) {
+  for (int i = 0; i < a->count; i++) {
+    lval_print(stdout, a->cell[i]);
+    putchar(i != a->count - 1 ? ' ' : '\n');
+  }
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/*
+ * Memory statistics, as a list of {name value} pairs (see lgc_stats)
+ *
+ * NOTE: the arguments are ignored, they are only there because a function is
+ * not called without any, e.g. "gc-stats ()".
+ */
+static lval *builtin_gc_stats(lenv *e, lval *a) {
+  lval_del(a);
+
+  char *names[] = {"collections", "slabs-freed", "pause-total-us",
+                   "pause-max-us", "live-nodes",  "live-bytes",
+                   "heap-bytes"};
+  lgc_stats *gc = &lcur->gc;
+  long vals[] = {gc->collections,  gc->slabs_freed, gc->pause_total_us,
+                 gc->pause_max_us, gc->live_nodes,  gc->live_bytes,
+                 gc->heap_bytes};
+  lval *x = lval_qexpr();
+  for (int i = 0; i < 7; i++) {
+    lval *pair = lval_qexpr();
+    pair = lval_add(pair, lval_sym(names[i]));
+    pair = lval_add(pair, lval_num(vals[i]));
+    x = lval_add(x, pair);
+  }
+  return x;
+}
+
+static lval *builtin_lambda(lenv *e, lval *a) {
+  /* Check two arguments, each of which are Q-Expresisons */
+  LASSERT(a, a->count == 2, "Wrong number of arg to lambda definition");
+  LASSERT(a,
+          lval_type(a->cell[0]) == LVAL_QEXPR &&
+              lval_type(a->cell[1]) == LVAL_QEXPR,
+          "Wrong type for arg or body to lambda definition");
+
+  /* Sanity check */
+  for (int i = 0; i < a->cell[0]->count; i++) {
+    LASSERT(a, lval_type(a->cell[0]->cell[i]) == LVAL_SYM,
+            "Wrong type for arg to lambda definition");
+  }
+  lval *formals = lval_pop(a, 0);
+  lval *body = lval_pop(a, 0);
+  lval_del(a);
+  return lval_lambda(formals, body);
+}
+
+/*
+ * Every builtin and the name it is defined as
+ *
+ * NOTE: images refer to builtins by these names (see limage_put), so renaming
+ * one makes older images that use it fail to load.
+ */
+typedef struct {
+  char *name;
+  lbuiltin func;
+} lbuiltin_def;
+
+static const lbuiltin_def lbuiltins[] = {
+    /* List Functions */
+    {"list", builtin_list},
+    {"head", builtin_head},
+    {"tail", builtin_tail},
+    {"eval", builtin_eval},
+    {"join", builtin_join},
+    {"min", builtin_min},
+    {"max", builtin_max},
+
+    /* Sequence Functions */
+    {"range", builtin_range},
+    {"iterate", builtin_iterate},
+    {"take", builtin_take},
+    {"foldl", builtin_foldl},
+    {"map", builtin_map},
+    {"filter", builtin_filter},
+    {"len", builtin_len},
+    {"pmap", builtin_pmap},
+    {"preduce", builtin_preduce},
+
+    /* Mathematical Functions */
+    {"+", builtin_add},
+    {"-", builtin_sub},
+    {"*", builtin_mul},
+    {"/", builtin_div},
+
+    /* Variable Functions */
+    {"def", builtin_def},
+    {"=", builtin_put},
+
+    /* Lambda Function */
+    {"\\", builtin_lambda},
+
+    /* Scripts */
+    {"load", builtin_load},
+    {"save-image", builtin_save_image},
+    {"print", builtin_print},
+
+    /* Memory */
+    {"gc-stats", builtin_gc_stats},
+};
+
+#define LBUILTIN_COUNT (int)(sizeof(lbuiltins) / sizeof(lbuiltin_def))
+
+static void lenv_add_builtins(lenv *e) {
+  for (int i = 0; i < LBUILTIN_COUNT; i++) {
+    lenv_add_builtin(e, lbuiltins[i].name, lbuiltins[i].func);
+  }
+}
+
+static lval *lval_apply(lenv *e, lval *v, ltail *t);
+static lval *lval_eval_sexpr(lenv *e, lval *v, ltail *t) {
+  /* "(x)" evaluates to whatever "x" does, so "x" is in tail position */
+  if (v->count == 1 && lval_type(v->cell[0]) == LVAL_SEXPR) {
+    t->env = e;
+    t->expr = lval_take(v, 0);
+    t->code = NULL;
+    t->frame = NULL;
+    return NULL;
+  }
+
+  for (int i = 0; i < v->count; i++) {
+    /* NOTE: numbers evaluate to themselves, skip the call for those */
+    if (!lval_is_fixnum(v->cell[i])) {
+      v->cell[i] = lval_eval(e, v->cell[i]);
+    }
+  }
+  return lval_apply(e, v, t);
+}
+
+/*
+ * Finish evaluating an S-Expression whose elements have all been evaluated:
+ * pass on errors, and call the function in the first element with the rest
+ */
+static lval *lval_apply(lenv *e, lval *v, ltail *t) {
+  /* Error checking */
+  for (int i = 0; i < v->count; i++) {
+    if (lval_type(v->cell[i]) == LVAL_ERR) {
+      return lval_take(v, i);
+    }
+  }
+
+  /* Empty expression */
+  if (v->count == 0) {
+    return v;
+  }
+
+  /* Single expression */
+  if (v->count == 1) {
+    return lval_take(v, 0);
+  }
+
+  /* Ensure first element is symbol */
+  lval *f = lval_pop(v, 0);
+  if (lval_type(f) != LVAL_FUN) {
+    lval_del(f);
+    lval_del(v);
+    return lval_err("First element is not a function!");
+  }
+
+  return lval_call(e, f, v, t);
+}
+
+/*
+ * Bytecode
+ *
+ * When a lambda is created its body is compiled by lcode_compile into a
+ * short program for the stack machine in lvm_run, so calls no longer copy
+ * the body and walk it as an S-Expression. The program does exactly what
+ * lval_eval_sexpr would do with the body:
+ *
+ *   LOP_CONST k   push consts[k], a value that evaluates to itself
+ *   LOP_LOCAL k   push the k-th argument of the lambda
+ *   LOP_LOOKUP k  push the value of the symbol consts[k]
+ *   LOP_CALL n    pop n values and finish them as an S-Expression (see
+ *                 lval_apply), push the result
+ *   LOP_TAIL n    as LOP_CALL, but that is the result of the body, so a
+ *                 lambda or 'eval' becomes a tail call (see ltail)
+ *   LOP_RETURN    the top of the stack is the result of the body
+ *
+ * The code is shared by all copies of a lambda. Everything else (the REPL
+ * input, what 'eval' is given) is still evaluated by walking the tree.
+ *
+ * NOTE: lval_call binds the arguments into the lambda's (empty) environment
+ * in the order of its formals, so the k-th distinct formal always sits at
+ * position k of the frame. References to formals are resolved to that
+ * position when compiling (LOP_LOCAL), only the remaining, free symbols are
+ * looked up by name. Since free symbols are resolved through the caller
+ * (see lval_call), a lambda's own formals are the only ones whose position
+ * is known in advance.
+ */
+enum { LOP_CONST, LOP_LOCAL, LOP_LOOKUP, LOP_CALL, LOP_TAIL, LOP_RETURN };
+
+struct lcode {
+  int refs;
+
+  int count;
+  int cap;
+  int *ops;
+
+  /* Constants and symbols the code refers to, as a Q-Expression */
+  lval *consts;
+
+  /* The formals of the lambda, while it is being compiled */
+  lval *formals;
+
+  /* How deep the stack gets */
+  int depth;
+  int max_depth;
+};
+
+static lcode *lcode_share(lcode *c) {
+  if (c) {
+    lref_inc(&c->refs);
+  }
+  return c;
+}
+
+static void lcode_del(lcode *c) {
+  if (lref_dec(&c->refs) > 0) {
+    return;
+  }
+  lval_del(c->consts);
+  free(c->ops);
+  free(c);
+}
+
+static void lcode_emit(lcode *c, int op, int arg) {
+  if (c->count + 2 > c->cap) {
+    c->cap = c->cap ? c->cap * 2 : 16;
+    c->ops = realloc(c->ops, sizeof(int) * c->cap);
+  }
+  c->ops[c->count++] = op;
+  c->ops[c->count++] = arg;
+}
+
+static void lcode_push(lcode *c, int op, lval *v) {
+  if (op == LOP_LOCAL) {
+    lcode_emit(c, op, lval_long(v));
+  } else {
+    c->consts = lval_add(c->consts, lval_share(v));
+    lcode_emit(c, op, c->consts->count - 1);
+  }
+  if (++c->depth > c->max_depth) {
+    c->max_depth = c->depth;
+  }
+}
+
+/* The frame position of formal "sym", or -1 if it is not one */
+static int lcode_local(lcode *c, char *sym) {
+  char *amp = lcur->amp;
+  int slot = 0;
+  for (int i = 0; i < c->formals->count; i++) {
+    char *name = c->formals->cell[i]->sym;
+    if (name == amp) {
+      continue;
+    }
+    /* NOTE: a repeated formal is bound again at its first position */
+    int seen = 0;
+    for (int j = 0; j < i; j++) {
+      seen |= c->formals->cell[j]->sym == name;
+    }
+    if (seen) {
+      continue;
+    }
+    if (name == sym) {
+      return slot;
+    }
+    slot++;
+  }
+  return -1;
+}
+
+static void lcode_expr(lcode *c, lval *v, int tail);
+
+/* Compile the elements of a list as an S-Expression */
+static void lcode_list(lcode *c, lval *v, int tail) {
+  if (v->count == 1 && lval_type(v->cell[0]) == LVAL_SEXPR) {
+    lcode_expr(c, v->cell[0], tail);
+    return;
+  }
+  for (int i = 0; i < v->count; i++) {
+    lcode_expr(c, v->cell[i], 0);
+  }
+  lcode_emit(c, tail ? LOP_TAIL : LOP_CALL, v->count);
+  c->depth -= v->count - 1;
+}
+
+static void lcode_expr(lcode *c, lval *v, int tail) {
+  switch (lval_type(v)) {
+  case LVAL_SEXPR:
+    lcode_list(c, v, tail);
+    return;
+  case LVAL_SYM: {
+    int slot = lcode_local(c, v->sym);
+    if (slot >= 0) {
+      lcode_push(c, LOP_LOCAL, lval_num(slot));
+    } else {
+      lcode_push(c, LOP_LOOKUP, v);
+    }
+    break;
+  }
+  default:
+    lcode_push(c, LOP_CONST, v);
+    break;
+  }
+  if (tail) {
+    lcode_emit(c, LOP_RETURN, 0);
+  }
+}
+
+static lcode *lcode_compile(lval *formals, lval *body) {
+  lcode *c = malloc(sizeof(lcode));
+  c->refs = 1;
+  c->count = 0;
+  c->cap = 0;
+  c->ops = NULL;
+  c->consts = lval_qexpr();
+  c->formals = formals;
+  c->depth = 0;
+  c->max_depth = 1;
+  lcode_list(c, body, 1);
+  c->formals = NULL;
+  return c;
+}
+
+#define LVM_STACK 32
+
+static lval *lvm_run(lenv *e, lcode *c, ltail *t) {
+  lval *small[LVM_STACK];
+  lval **stack = c->max_depth <= LVM_STACK
+                     ? small
+                     : malloc(sizeof(lval *) * c->max_depth);
+  int sp = 0;
+  int *pc = c->ops;
+  lval *x = NULL;
+
+  for (;;) {
+    int op = pc[0];
+    int arg = pc[1];
+    pc += 2;
+
+    if (op == LOP_CONST) {
+      stack[sp++] = lval_share(c->consts->cell[arg]);
+      continue;
+    }
+    if (op == LOP_LOCAL) {
+      stack[sp++] = lval_share(lenv_slot(e, arg));
+      continue;
+    }
+    if (op == LOP_LOOKUP) {
+      stack[sp++] = lenv_get(e, c->consts->cell[arg]);
+      continue;
+    }
+    if (op == LOP_RETURN) {
+      x = stack[--sp];
+      break;
+    }
+
+    /* LOP_CALL and LOP_TAIL, gather the S-Expression from the stack */
+    sp -= arg;
+    lval *v = lval_sexpr();
+    lval_reserve(v, arg);
+    memcpy(v->cell, &stack[sp], sizeof(lval *) * arg);
+    v->count = arg;
+
+    if (op == LOP_TAIL) {
+      x = lval_apply(e, v, t);
+      break;
+    }
+    ltail call;
+    lval *res = lval_apply(e, v, &call);
+    stack[sp++] = res ? res : lval_resume(&call);
+  }
+
+  if (stack != small) {
+    free(stack);
+  }
+  return x;
+}
+
+/*
+ * Scripts
+ *
+ * 'load' and the command line (see q_expressions.c) run files of expressions.
+ * Each one is evaluated as soon as it has been read, so neither the whole
+ * input nor all of its values are held at once, and unlike a REPL line an
+ * expression may span any number of lines. Regular files are mapped into
+ * memory and read in place. Anything else (a pipe, a terminal) is read a
+ * chunk at a time, keeping only the text from the start of the current line
+ * on.
+ *
+ * NOTE: what is read of a regular file is also written to a cache as it goes
+ * (see lmodule_put), and the next time the file is loaded its expressions
+ * come from there instead.
+ */
+typedef struct {
+  FILE *f;
+  char *buf;
+  size_t len;
+  size_t cap;
+  int mapped;
+  int eof;
+} linput;
+
+/* Open "path" ("-" for the standard input), 0 with errno set on failure */
+static int linput_open(linput *in, const char *path) {
+  in->f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+  if (!in->f) {
+    return 0;
+  }
+  in->buf = NULL;
+  in->len = 0;
+  in->cap = 0;
+  in->mapped = 0;
+  in->eof = 0;
+
+#ifndef _WIN32
+  struct stat st;
+  if (fstat(fileno(in->f), &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_size > 0) {
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(in->f), 0);
+    if (p != MAP_FAILED) {
+      in->buf = p;
+      in->len = st.st_size;
+      in->cap = st.st_size;
+      in->mapped = 1;
+      in->eof = 1;
+    }
+  }
+#endif
+  return 1;
+}
+
+/* Drop the first "keep" bytes of the buffer and read more after the rest */
+static void linput_more(linput *in, size_t keep) {
+  if (keep) {
+    memmove(in->buf, in->buf + keep, in->len - keep);
+    in->len -= keep;
+  }
+  if (in->len == in->cap) {
+    in->cap = in->cap ? in->cap * 2 : 65536;
+    in->buf = realloc(in->buf, in->cap);
+  }
+
+  /* NOTE: read() hands over whatever is there, fread() waits for it all */
+#ifndef _WIN32
+  ssize_t n = read(fileno(in->f), in->buf + in->len, in->cap - in->len);
+  n = n < 0 ? 0 : n;
+#else
+  size_t n = fread(in->buf + in->len, 1, in->cap - in->len, in->f);
+#endif
+  in->len += n;
+  in->eof = n == 0;
+}
+
+static void linput_close(linput *in) {
+#ifndef _WIN32
+  if (in->mapped) {
+    munmap(in->buf, in->cap);
+  } else
+#endif
+  {
+    free(in->buf);
+  }
+  if (in->f != stdin) {
+    fclose(in->f);
+  }
+}
+
+/* Evaluate an expression of a script */
+static void lenv_load_eval(lenv *e, lval *x, FILE *out, int *failed) {
+  lval *y = lval_eval(e, x);
+  if (lval_type(y) == LVAL_ERR) {
+    if (out) {
+      lval_println(out, y);
+    }
+    if (failed) {
+      *failed = 1;
+    }
+  }
+  lval_del(y);
+  lslab_release();
+}
+
+/*
+ * Module cache
+ *
+ * Reading a script can take longer than running it, when it mostly defines
+ * things, so 'load' writes the expressions it reads from a script to a cache
+ * next to it ("lib.lspy" in "lib.lispyc") as it goes, and the next time the
+ * same text is loaded they are read from there instead. Setting LISPY_CACHE
+ * to 0 turns this off.
+ *
+ * After the header (see lmodule_header) the cache holds the expressions one
+ * after another, each value a tag followed by what it needs:
+ *
+ *   number      the number, zigzag encoded
+ *   symbol      the position of its name among those seen so far
+ *   new symbol  the length of a name not seen so far, then the name
+ *   string      the length, then the bytes
+ *   error       the same, for what the reader gives "invalid number"
+ *   S/Q-Expr    the number of elements, which follow
+ *
+ * The low 3 bits of a tag say which of these it is. The high 5 bits hold the
+ * number that follows if it is below 31; otherwise they are all set and the
+ * number, less 31, follows as a LEB128 varint. Most symbols take one byte.
+ *
+ * The key of a cache is a hash of the text of the script, so one that has
+ * changed since is read again and its cache replaced. The header also holds a
+ * checksum of the rest, and a cache that does not match it is ignored before
+ * any of it runs.
+ *
+ * NOTE: only the reading is saved. Nothing can be compiled ahead, lambdas
+ * only come into being as the expressions run.
+ */
+#define LMODULE_MAGIC 0x646f6d797073696cL
+#define LMODULE_VERSION 1
+#define LMODULE_SEED 14695981039346656037UL
+
+enum {
+  LMODULE_NUM,
+  LMODULE_SYM,
+  LMODULE_NEW_SYM,
+  LMODULE_STR,
+  LMODULE_ERR,
+  LMODULE_SEXPR,
+  LMODULE_QEXPR
+};
+
+typedef struct {
+  int64_t magic;
+  int64_t version;
+  /* The hash of the script, and the checksum of what follows */
+  int64_t key;
+  int64_t sum;
+} lmodule_header;
+
+/* A cache being written */
+typedef struct {
+  FILE *f;
+  char *path;
+  char *tmp;
+  unsigned long key;
+  unsigned long sum;
+  /* What has not been written yet, less than a word of it between calls */
+  unsigned char *buf;
+  size_t len;
+  size_t cap;
+  /* The position of each symbol written so far, by its interned name */
+  char **syms;
+  long *pos;
+  long mask;
+  long count;
+  /* The lists being written, innermost last, and how far each one is */
+  lval **open;
+  int *at;
+  int depth;
+  int open_cap;
+} lmodule;
+
+/* "path" with the extension ".lispyc" instead of its own */
+static char *lmodule_path(const char *path) {
+  const char *dot = strrchr(path, '.');
+  const char *slash = strrchr(path, '/');
+  size_t n = dot && (!slash || dot > slash) ? (size_t)(dot - path)
+                                            : strlen(path);
+  char *cache = malloc(n + 8);
+  memcpy(cache, path, n);
+  strcpy(cache + n, ".lispyc");
+  return cache;
+}
+
+/*
+ * Carry the hash "h" on over the "n" bytes at "s". This is FNV-1a a word
+ * rather than a byte at a time, so hashing a whole script costs little next
+ * to reading it. Hashing in parts gives the same as hashing in one go as long
+ * as all but the last part are whole words.
+ */
+static unsigned long lmodule_sum(unsigned long h, const unsigned char *s,
+                                 size_t n) {
+  for (; n >= 8; s += 8, n -= 8) {
+    uint64_t w;
+    memcpy(&w, s, 8);
+    h = (h ^ w) * 1099511628211UL;
+    h ^= h >> 32;
+  }
+  for (; n; s++, n--) {
+    h = (h ^ *s) * 1099511628211UL;
+  }
+  return h;
+}
+
+/* Start writing the cache "path" of the script with the hash "key" */
+static int lmodule_create(lmodule *m, const char *path, unsigned long key) {
+  memset(m, 0, sizeof(lmodule));
+  m->tmp = malloc(strlen(path) + 8);
+  sprintf(m->tmp, "%s.tmp", path);
+  m->f = fopen(m->tmp, "wb");
+  lmodule_header h = {0};
+  if (!m->f || fwrite(&h, sizeof(h), 1, m->f) != 1) {
+    if (m->f) {
+      fclose(m->f);
+      remove(m->tmp);
+    }
+    free(m->tmp);
+    return 0;
+  }
+  m->path = malloc(strlen(path) + 1);
+  strcpy(m->path, path);
+  m->key = key;
+  m->sum = LMODULE_SEED;
+  m->mask = 255;
+  m->syms = calloc(m->mask + 1, sizeof(char *));
+  m->pos = malloc(sizeof(long) * (m->mask + 1));
+  return 1;
+}
+
+static inline void lmodule_bytes(lmodule *m, const void *s, size_t n) {
+  if (m->len + n > m->cap) {
+    while (m->len + n > m->cap) {
+      m->cap = m->cap ? m->cap * 2 : 4096;
+    }
+    m->buf = realloc(m->buf, m->cap);
+  }
+  memcpy(m->buf + m->len, s, n);
+  m->len += n;
+}
+
+static inline void lmodule_tag(lmodule *m, int kind, unsigned long n) {
+  unsigned char b[12];
+  int len = 1;
+  if (n < 31) {
+    b[0] = kind | n << 3;
+  } else {
+    b[0] = kind | 31 << 3;
+    for (n -= 31; n >= 128; n >>= 7) {
+      b[len++] = (n & 127) | 128;
+    }
+    b[len++] = n;
+  }
+  lmodule_bytes(m, b, len);
+}
+
+/* The slot of "sym" among the symbols written, empty if it is not */
+static long lmodule_find(lmodule *m, char *sym) {
+  unsigned long h = lenv_hash(sym) & m->mask;
+  while (m->syms[h] && m->syms[h] != sym) {
+    h = (h + 1) & m->mask;
+  }
+  return h;
+}
+
+static void lmodule_sym(lmodule *m, char *sym) {
+  long h = lmodule_find(m, sym);
+  if (m->syms[h]) {
+    lmodule_tag(m, LMODULE_SYM, m->pos[h]);
+    return;
+  }
+  size_t n = strlen(sym);
+  lmodule_tag(m, LMODULE_NEW_SYM, n);
+  lmodule_bytes(m, sym, n);
+  m->syms[h] = sym;
+  m->pos[h] = m->count++;
+
+  if (m->count * 2 > m->mask + 1) {
+    char **syms = m->syms;
+    long *pos = m->pos;
+    long size = m->mask + 1;
+    m->mask = size * 2 - 1;
+    m->syms = calloc(size * 2, sizeof(char *));
+    m->pos = malloc(sizeof(long) * size * 2);
+    for (long i = 0; i < size; i++) {
+      if (syms[i]) {
+        h = lmodule_find(m, syms[i]);
+        m->syms[h] = syms[i];
+        m->pos[h] = pos[i];
+      }
+    }
+    free(syms);
+    free(pos);
+  }
+}
+
+/* Append the expression "x", as the reader gave it, to the cache */
+static void lmodule_put(lmodule *m, lval *x) {
+  while (1) {
+    switch (lval_type(x)) {
+    case LVAL_NUM: {
+      long n = lval_long(x);
+      lmodule_tag(m, LMODULE_NUM,
+                  n < 0 ? ~((unsigned long)n << 1) : (unsigned long)n << 1);
+      break;
+    }
+    case LVAL_SYM:
+      lmodule_sym(m, x->sym);
+      break;
+    case LVAL_STR:
+    case LVAL_ERR:
+      lmodule_tag(m, x->type == LVAL_STR ? LMODULE_STR : LMODULE_ERR,
+                  strlen(x->str));
+      lmodule_bytes(m, x->str, strlen(x->str));
+      break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      lmodule_tag(m, x->type == LVAL_SEXPR ? LMODULE_SEXPR : LMODULE_QEXPR,
+                  x->count);
+      if (x->count) {
+        if (m->depth == m->open_cap) {
+          m->open_cap = m->open_cap ? m->open_cap * 2 : 8;
+          m->open = realloc(m->open, sizeof(lval *) * m->open_cap);
+          m->at = realloc(m->at, sizeof(int) * m->open_cap);
+        }
+        m->open[m->depth] = x;
+        m->at[m->depth++] = 0;
+      }
+      break;
+    }
+
+    while (m->depth && m->at[m->depth - 1] == m->open[m->depth - 1]->count) {
+      m->depth--;
+    }
+    if (!m->depth) {
+      break;
+    }
+    x = m->open[m->depth - 1]->cell[m->at[m->depth - 1]++];
+  }
+
+  /* NOTE: whole words only, see lmodule_sum */
+  size_t n = m->len & ~(size_t)7;
+  m->sum = lmodule_sum(m->sum, m->buf, n);
+  if (m->f && fwrite(m->buf, 1, n, m->f) != n) {
+    fclose(m->f);
+    m->f = NULL;
+  }
+  memmove(m->buf, m->buf + n, m->len - n);
+  m->len -= n;
+}
+
+/*
+ * Finish the cache, and keep it if "keep" is set
+ *
+ * NOTE: the cache is written next to its path and then renamed, so whoever
+ * loads the script meanwhile gets the old cache or the new one but never half
+ * of one. A cache that cannot be written is left out, the script still loads.
+ */
+static void lmodule_close(lmodule *m, int keep) {
+  m->sum = lmodule_sum(m->sum, m->buf, m->len);
+  lmodule_header h = {LMODULE_MAGIC, LMODULE_VERSION, (int64_t)m->key,
+                      (int64_t)m->sum};
+  int ok = keep && m->f && fwrite(m->buf, 1, m->len, m->f) == m->len &&
+           fseek(m->f, 0, SEEK_SET) == 0 &&
+           fwrite(&h, sizeof(h), 1, m->f) == 1;
+  if (m->f && fclose(m->f) != 0) {
+    ok = 0;
+  }
+#ifdef _WIN32
+  /* NOTE: rename does not replace a file there */
+  if (ok) {
+    remove(m->path);
+  }
+#endif
+  if (!ok || rename(m->tmp, m->path) != 0) {
+    remove(m->tmp);
+  }
+  free(m->path);
+  free(m->tmp);
+  free(m->buf);
+  free(m->syms);
+  free(m->pos);
+  free(m->open);
+  free(m->at);
+}
+
+/* A cache being read */
+typedef struct {
+  const unsigned char *s;
+  const unsigned char *end;
+  /* The names of the symbols so far */
+  char **syms;
+  long count;
+  long cap;
+  /* The lists being read, innermost last, and how many elements each lacks */
+  lval **open;
+  unsigned long *left;
+  int depth;
+  int open_cap;
+} lmodule_reader;
+
+/* Read a tag, 0 if there is none */
+static inline int lmodule_tag_read(lmodule_reader *r, int *kind,
+                                   unsigned long *n) {
+  if (r->s == r->end) {
+    return 0;
+  }
+  *kind = *r->s & 7;
+  *n = *r->s++ >> 3;
+  if (*n < 31) {
+    return 1;
+  }
+  unsigned long x = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (r->s == r->end) {
+      return 0;
+    }
+    x |= (unsigned long)(*r->s & 127) << shift;
+    if (!(*r->s++ & 128)) {
+      *n = 31 + x;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Read the next expression of the cache, NULL if it does not hold a whole
+ * one there
+ *
+ * NOTE: a cache that passed its checksum always does; the checks here only
+ * keep one made to pass it from reading outside of it.
+ */
+static lval *lmodule_read(lmodule_reader *r) {
+  lval *x = NULL;
+  while (1) {
+    int kind;
+    unsigned long n;
+    if (!lmodule_tag_read(r, &kind, &n)) {
+      break;
+    }
+    unsigned long rest = r->end - r->s;
+    if (kind == LMODULE_NUM) {
+      x = lval_num(n & 1 ? (long)~(n >> 1) : (long)(n >> 1));
+    } else if (kind == LMODULE_SYM && n < (unsigned long)r->count) {
+      x = lval_sym_interned(r->syms[n]);
+    } else if (kind == LMODULE_NEW_SYM && n <= rest) {
+      if (r->count == r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 256;
+        r->syms = realloc(r->syms, sizeof(char *) * r->cap);
+      }
+      x = lval_sym_interned(lval_intern_n((const char *)r->s, n));
+      r->syms[r->count++] = x->sym;
+      r->s += n;
+    } else if (kind == LMODULE_STR && n <= rest) {
+      x = lval_str((const char *)r->s, n);
+      r->s += n;
+    } else if (kind == LMODULE_ERR && n <= rest) {
+      char *err = malloc(n + 1);
+      memcpy(err, r->s, n);
+      err[n] = '\0';
+      x = lval_err(err);
+      free(err);
+      r->s += n;
+    } else if ((kind == LMODULE_SEXPR || kind == LMODULE_QEXPR) &&
+               n <= rest) {
+      /* NOTE: every element takes a byte at least, so "n" fits in an int */
+      x = kind == LMODULE_SEXPR ? lval_sexpr() : lval_qexpr();
+      if (n) {
+        lval_reserve(x, n);
+        if (r->depth == r->open_cap) {
+          r->open_cap = r->open_cap ? r->open_cap * 2 : 8;
+          r->open = realloc(r->open, sizeof(lval *) * r->open_cap);
+          r->left = realloc(r->left, sizeof(unsigned long) * r->open_cap);
+        }
+        r->open[r->depth] = x;
+        r->left[r->depth++] = n;
+        x = NULL;
+        continue;
+      }
+    } else {
+      break;
+    }
+
+    while (r->depth) {
+      r->open[r->depth - 1] = lval_add(r->open[r->depth - 1], x);
+      if (--r->left[r->depth - 1]) {
+        break;
+      }
+      x = r->open[--r->depth];
+    }
+    if (!r->depth) {
+      return x;
+    }
+    x = NULL;
+  }
+
+  while (r->depth) {
+    lval_del(r->open[--r->depth]);
+  }
+  return NULL;
+}
+
+/*
+ * Evaluate the expressions cached in "path" for the script with the hash
+ * "key", as lenv_load does, and return what it would. NULL, with nothing
+ * evaluated, if there is no such cache or it is damaged.
+ */
+static lval *lmodule_load(lenv *e, const char *path, unsigned long key,
+                          FILE *out, int *failed) {
+  linput in;
+  if (!linput_open(&in, path)) {
+    return NULL;
+  }
+  lmodule_header h;
+  int ok = in.mapped && in.len >= sizeof(h);
+  if (ok) {
+    memcpy(&h, in.buf, sizeof(h));
+  }
+  lmodule_reader r;
+  memset(&r, 0, sizeof(r));
+  r.s = (unsigned char *)in.buf + sizeof(h);
+  r.end = (unsigned char *)in.buf + in.len;
+  ok = ok && h.magic == LMODULE_MAGIC && h.version == LMODULE_VERSION &&
+       h.key == (int64_t)key &&
+       h.sum == (int64_t)lmodule_sum(LMODULE_SEED, r.s, r.end - r.s);
+
+  lval *res = ok ? lval_sexpr() : NULL;
+  while (ok && r.s < r.end) {
+    lval *x = lmodule_read(&r);
+    if (!x) {
+      lval_del(res);
+      res = lval_err("Cache is damaged!");
+      break;
+    }
+    lenv_load_eval(e, x, out, failed);
+  }
+  free(r.syms);
+  free(r.open);
+  free(r.left);
+  linput_close(&in);
+  return res;
+}
+
+/*
+ * Evaluate the expressions in "path" one after another. Errors they evaluate
+ * to are printed to "out" and the rest still run, but input that does not
+ * parse stops the file and is returned as an error. "failed", if given, is
+ * set when an expression evaluated to an error.
+ */
+static lval *lenv_load(lenv *e, const char *path, FILE *out, int *failed) {
+  linput in;
+  if (!linput_open(&in, path)) {
+    char *msg = strerror(errno);
+    char *err = malloc(strlen(path) + strlen(msg) + 32);
+    sprintf(err, "Could not load %s: %s", path, msg);
+    lval *x = lval_err(err);
+    free(err);
+    return x;
+  }
+
+  const char *name = strcmp(path, "-") == 0 ? "<stdin>" : path;
+
+  /* NOTE: not from 'pmap' workers, which would all write the same cache */
+  char *env = getenv("LISPY_CACHE");
+  int caching = in.mapped && !lparallel && !(env && strcmp(env, "0") == 0);
+  char *cache = caching ? lmodule_path(path) : NULL;
+  if (cache && strcmp(cache, path) == 0) {
+    free(cache);
+    cache = NULL;
+  }
+  unsigned long key =
+      cache ? lmodule_sum(LMODULE_SEED, (unsigned char *)in.buf, in.len) : 0;
+  lval *res = cache ? lmodule_load(e, cache, key, out, failed) : NULL;
+  if (res) {
+    free(cache);
+    linput_close(&in);
+    return res;
+  }
+  lmodule m;
+  caching = cache && lmodule_create(&m, cache, key);
+  free(cache);
+
+  /* Where the next expression starts, and the line it starts on */
+  size_t start = 0;
+  size_t bol = 0;
+  int line = 1;
+
+  while (!res) {
+    lreader r;
+    lreader_init(&r, name, in.buf + bol, in.len - bol);
+    r.s = in.buf + start;
+    r.line = line;
+    lreader_skip(&r);
+
+    /*
+     * NOTE: unless the input is over, an expression that runs into the end
+     * of the buffer may be cut short ("(1 2", or "12" of "123"), so read more
+     * and try it again
+     */
+    lval *x = r.s < r.end ? lreader_expr(&r) : NULL;
+    int more = r.s == r.end && !in.eof;
+    if (!x && !more && r.err) {
+      r.err[strlen(r.err) - 1] = '\0';
+      res = lval_err(r.err);
+    } else if (!x && !more) {
+      res = lval_sexpr();
+    }
+    free(r.err);
+    if (!x || more) {
+      if (x) {
+        lval_del(x);
+      }
+      if (more) {
+        linput_more(&in, bol);
+        start -= bol;
+        bol = 0;
+      }
+      continue;
+    }
+
+    start = r.s - in.buf;
+    bol = r.bol - in.buf;
+    line = r.line;
+
+    if (caching) {
+      lmodule_put(&m, x);
+    }
+    lenv_load_eval(e, x, out, failed);
+  }
+
+  /* NOTE: only a file that reads to the end is cached */
+  if (caching) {
+    lmodule_close(&m, lval_type(res) != LVAL_ERR);
+  }
+  linput_close(&in);
+  return res;
+}
+
+/*
+ * Images
+ *
+ * 'save-image' writes the global environment to a file that a new interpreter
+ * can start from (see lispy_load_image) without reading or evaluating the
+ * scripts that built it.
+ *
+ * An image holds the values themselves, laid out as they are in memory. The
+ * pointers in it are offsets from the start of the file, so loading maps the
+ * file and adds the address it got mapped at to each of them instead of
+ * allocating anything, and starting from an image costs about as much as
+ * touching its pages. After the header (see limage_header) the file has
+ *
+ *   heap           the values, their cells, strings and code
+ *   symbols        the names of the symbols they use, with their flags
+ *   relocations    a bit for each word of the heap, set for the pointers; 0
+ *                  is NULL and a fixnum (see lval_num) is left as it is
+ *   symbol fixes   (position, symbol) pairs of names to intern
+ *   builtin fixes  (position, symbol) pairs of builtins, by name (see
+ *                  lbuiltins)
+ *   roots          the values the image is about; for an environment
+ *                  (symbol, value) pairs of its bindings
+ *
+ * NOTE: the values of an image are never freed. Their counts start at
+ * LIMAGE_REFS, which no number of lval_del brings down to 0, and as the
+ * count is never 1 either lval_own copies them before any change. The file
+ * is mapped private, so the counts that change in memory never get written
+ * back to it. It stays mapped for as long as the interpreter is there.
+ *
+ * NOTE: the layout of values differs between builds, which the header
+ * checks (see LIMAGE_LAYOUT). The header also holds a checksum of the rest,
+ * so an image damaged since it was written is refused before anything in it
+ * is used. Beyond that an image is trusted as a script is: only its pointers
+ * are checked to point into it.
+ */
+#define LIMAGE_MAGIC 0x676d69797073696cL
+#define LIMAGE_VERSION 4
+#define LIMAGE_LAYOUT                                                          \
+  ((int64_t)sizeof(lval) << 32 | sizeof(lcode) << 16 | sizeof(lcells) << 8 |  \
+   LVAL_INLINE_CELLS)
+#define LIMAGE_REFS (INT_MAX / 2)
+
+/* The number of symbols, and the size of each section in words */
+typedef struct {
+  int64_t magic;
+  int64_t version;
+  int64_t layout;
+  /* The checksum of everything after the header (see lmodule_sum) */
+  int64_t sum;
+  int64_t heap;
+  int64_t symbols;
+  int64_t symbol_words;
+  int64_t relocations;
+  int64_t symbol_fixes;
+  int64_t builtin_fixes;
+  int64_t roots;
+} limage_header;
+
+typedef struct {
+  int64_t *w;
+  size_t len;
+  size_t cap;
+} lwords;
+
+/* Make room for "n" more words, returning the position of the first */
+static size_t lwords_grow(lwords *s, size_t n) {
+  while (s->len + n > s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 1024;
+    s->w = realloc(s->w, sizeof(int64_t) * s->cap);
+  }
+  memset(s->w + s->len, 0, sizeof(int64_t) * n);
+  s->len += n;
+  return s->len - n;
+}
+
+static void lwords_add(lwords *s, int64_t w) {
+  size_t at = lwords_grow(s, 1);
+  s->w[at] = w;
+}
+
+typedef struct {
+  /* What has been written, and where (or which symbol it is) */
+  void **keys;
+  int64_t *offs;
+  long mask;
+  long count;
+
+  lwords heap;
+  lwords symbols;
+  lwords relocations;
+  lwords symbol_fixes;
+  lwords builtin_fixes;
+  lwords roots;
+  long nsymbols;
+  /* The LVAL_SYM written for each symbol, if any */
+  lwords symbol_vals;
+} limage;
+
+static void limage_init(limage *w) {
+  memset(w, 0, sizeof(limage));
+  w->mask = 255;
+  w->keys = calloc(w->mask + 1, sizeof(void *));
+  w->offs = malloc(sizeof(int64_t) * (w->mask + 1));
+}
+
+static void limage_free(limage *w) {
+  lwords *parts[] = {&w->heap,         &w->symbols,       &w->relocations,
+                     &w->symbol_fixes, &w->builtin_fixes, &w->roots,
+                     &w->symbol_vals};
+  for (int i = 0; i < 7; i++) {
+    free(parts[i]->w);
+  }
+  free(w->keys);
+  free(w->offs);
+}
+
+/* The slot of "key" among what has been written, empty if it is not */
+static long limage_find(limage *w, void *key) {
+  unsigned long h = lenv_hash(key) & w->mask;
+  while (w->keys[h] && w->keys[h] != key) {
+    h = (h + 1) & w->mask;
+  }
+  return h;
+}
+
+static int64_t limage_remember(limage *w, void *key, int64_t off) {
+  if ((w->count + 1) * 2 > w->mask + 1) {
+    void **keys = w->keys;
+    int64_t *offs = w->offs;
+    long size = w->mask + 1;
+    w->mask = size * 2 - 1;
+    w->keys = calloc(size * 2, sizeof(void *));
+    w->offs = malloc(sizeof(int64_t) * size * 2);
+    for (long i = 0; i < size; i++) {
+      if (keys[i]) {
+        long h = limage_find(w, keys[i]);
+        w->keys[h] = keys[i];
+        w->offs[h] = offs[i];
+      }
+    }
+    free(keys);
+    free(offs);
+  }
+  long h = limage_find(w, key);
+  w->keys[h] = key;
+  w->offs[h] = off;
+  w->count++;
+  return off;
+}
+
+/* "size" zeroed bytes on the heap, returning their offset in the file */
+static int64_t limage_alloc(limage *w, size_t size) {
+  size_t at = lwords_grow(&w->heap, (size + 7) / 8);
+  return sizeof(limage_header) + at * 8;
+}
+
+static inline void *limage_at(limage *w, int64_t off) {
+  return (char *)w->heap.w + off - sizeof(limage_header);
+}
+
+/* Store the pointer "off" at "at", marking it to be relocated */
+static void limage_ptr(limage *w, int64_t at, int64_t off) {
+  *(int64_t *)limage_at(w, at) = off;
+  if (off && !(off & 1)) {
+    size_t i = (at - sizeof(limage_header)) / 8;
+    if (i / 64 >= w->relocations.len) {
+      lwords_grow(&w->relocations, i / 64 + 1 - w->relocations.len);
+    }
+    w->relocations.w[i / 64] |= (int64_t)((uint64_t)1 << (i % 64));
+  }
+}
+
+/* The position of the interned "sym" among the symbols of the image */
+static int64_t limage_sym(limage *w, char *sym) {
+  long h = limage_find(w, sym);
+  if (w->keys[h]) {
+    return w->offs[h];
+  }
+  size_t n = strlen(sym);
+  size_t at = lwords_grow(&w->symbols, 1 + (n + 7) / 8);
+  w->symbols.w[at] = (int64_t)n << 8 | sym[-1];
+  memcpy(&w->symbols.w[at + 1], sym, n);
+  lwords_add(&w->symbol_vals, 0);
+  return limage_remember(w, sym, w->nsymbols++);
+}
+
+/* Make the "char *" at "at" the interned "sym" once loaded */
+static void limage_sym_at(limage *w, int64_t at, char *sym) {
+  lwords_add(&w->symbol_fixes, at);
+  lwords_add(&w->symbol_fixes, limage_sym(w, sym));
+}
+
+/*
+ * The LVAL_SYM of the interned "sym"
+ *
+ * NOTE: one symbol of each name will do, as none of them ever changes
+ */
+static int64_t limage_sym_val(limage *w, char *sym) {
+  int64_t i = limage_sym(w, sym);
+  if (!w->symbol_vals.w[i]) {
+    int64_t off = limage_alloc(w, lval_size(LVAL_SYM));
+    lval_small *x = limage_at(w, off);
+    x->type = LVAL_SYM;
+    x->refs = LIMAGE_REFS;
+    limage_sym_at(w, off + offsetof(lval, sym), sym);
+    w->symbol_vals.w[i] = off;
+  }
+  return w->symbol_vals.w[i];
+}
+
+static int64_t limage_str(limage *w, char *s) {
+  int64_t off = limage_alloc(w, strlen(s) + 1);
+  strcpy(limage_at(w, off), s);
+  return off;
+}
+
+static int64_t limage_put(limage *w, lval *v);
+
+static int64_t limage_code(limage *w, lcode *c) {
+  long h = limage_find(w, c);
+  if (w->keys[h]) {
+    return w->offs[h];
+  }
+  int64_t consts = limage_put(w, c->consts);
+  int64_t ops = limage_alloc(w, sizeof(int) * c->count);
+  memcpy(limage_at(w, ops), c->ops, sizeof(int) * c->count);
+
+  int64_t off = limage_alloc(w, sizeof(lcode));
+  lcode *x = limage_at(w, off);
+  *x = *c;
+  x->refs = LIMAGE_REFS;
+  x->cap = c->count;
+  x->formals = NULL;
+  limage_ptr(w, off + offsetof(lcode, ops), ops);
+  limage_ptr(w, off + offsetof(lcode, consts), consts);
+  return limage_remember(w, c, off);
+}
+
+/* Write "v" and whatever it refers to, returning the pointer to it */
+static int64_t limage_put(limage *w, lval *v) {
+  if (!v) {
+    return 0;
+  }
+  if (lval_is_fixnum(v)) {
+    return (int64_t)(intptr_t)v;
+  }
+  if (v->type == LVAL_SYM) {
+    return limage_sym_val(w, v->sym);
+  }
+  long h = limage_find(w, v);
+  if (w->keys[h]) {
+    return w->offs[h];
+  }
+
+  /* NOTE: whatever "v" refers to goes first, so "x" below stays put */
+  int64_t a = 0, b = 0, c = 0;
+  int64_t *cells = NULL;
+  int list = v->type == LVAL_SEXPR || v->type == LVAL_QEXPR;
+  switch (v->type) {
+  case LVAL_ERR:
+  case LVAL_STR:
+    a = limage_str(w, v->str);
+    break;
+  case LVAL_FUN:
+    if (v->fn) {
+      a = limage_put(w, v->fn);
+      b = limage_put(w, v->args);
+    } else if (!v->builtin) {
+      a = limage_put(w, v->formals);
+      b = limage_put(w, v->body);
+      c = limage_code(w, v->code);
+    }
+    break;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    cells = malloc(sizeof(int64_t) * (v->count + 1));
+    for (int i = 0; i < v->count; i++) {
+      cells[i] = limage_put(w, v->cell[i]);
+    }
+    /* Longer lists keep their cells in storage that views may share */
+    if (v->count > LVAL_INLINE_CELLS) {
+      c = limage_alloc(w, sizeof(lcells) + sizeof(lval *) * v->count);
+      lcells *blk = limage_at(w, c);
+      blk->refs = LIMAGE_REFS;
+      blk->shared = 1;
+      blk->lo = 0;
+      blk->hi = v->count;
+      a = c + offsetof(lcells, cells);
+      for (int i = 0; i < v->count; i++) {
+        limage_ptr(w, a + sizeof(lval *) * i, cells[i]);
+      }
+    }
+    break;
+  case LVAL_SEQ:
+    a = limage_put(w, v->src);
+    b = limage_put(w, v->gen);
+    break;
+  }
+
+  int64_t off = limage_alloc(w, lval_size(v->type));
+  /* NOTE: see lval_alloc */
+  lval_small *sx = limage_at(w, off);
+  sx->type = v->type;
+  sx->refs = LIMAGE_REFS;
+  lval *x = (lval *)sx;
+  switch (v->type) {
+  case LVAL_NUM:
+    sx->num = v->num;
+    break;
+  case LVAL_ERR:
+  case LVAL_STR:
+    limage_ptr(w, off + offsetof(lval, str), a);
+    break;
+  case LVAL_FUN:
+    if (v->builtin) {
+      for (int i = 0; i < LBUILTIN_COUNT; i++) {
+        if (lbuiltins[i].func == v->builtin) {
+          lwords_add(&w->builtin_fixes, off + offsetof(lval, builtin));
+          lwords_add(&w->builtin_fixes,
+                     limage_sym(w, lval_intern(lbuiltins[i].name)));
+        }
+      }
+    } else if (v->fn) {
+      limage_ptr(w, off + offsetof(lval, fn), a);
+      limage_ptr(w, off + offsetof(lval, args), b);
+    } else {
+      limage_ptr(w, off + offsetof(lval, formals), a);
+      limage_ptr(w, off + offsetof(lval, body), b);
+      limage_ptr(w, off + offsetof(lval, code), c);
+    }
+    break;
+  case LVAL_SEXPR:
+  case LVAL_QEXPR:
+    x->count = v->count;
+    if (!c) {
+      x->cap = LVAL_INLINE_CELLS;
+      a = off + LVAL_LIST_SIZE;
+      for (int i = 0; i < v->count; i++) {
+        limage_ptr(w, a + sizeof(lval *) * i, cells[i]);
+      }
+    } else {
+      x->cap = v->count;
+    }
+    limage_ptr(w, off + offsetof(lval, cell), a);
+    limage_ptr(w, off + offsetof(lval, base), a);
+    break;
+  case LVAL_SEQ:
+    x->kind = v->kind;
+    x->at = v->at;
+    x->end = v->end;
+    x->step = v->step;
+    limage_ptr(w, off + offsetof(lval, src), a);
+    limage_ptr(w, off + offsetof(lval, gen), b);
+    break;
+  }
+  if (list) {
+    free(cells);
+  }
+  return limage_remember(w, v, off);
+}
+
+/*
+ * Write the image to "path", NULL or the error
+ *
+ * NOTE: the image is written next to "path" and then renamed, so whoever
+ * maps "path" meanwhile gets the old image or the new one but never half of
+ * one.
+ */
+static lval *limage_write(limage *w, const char *path) {
+  size_t bits = (w->heap.len + 63) / 64;
+  lwords_grow(&w->relocations, bits - w->relocations.len);
+  lwords *parts[] = {&w->heap,         &w->symbols,       &w->relocations,
+                     &w->symbol_fixes, &w->builtin_fixes, &w->roots};
+  unsigned long sum = LMODULE_SEED;
+  for (int i = 0; i < 6; i++) {
+    sum = lmodule_sum(sum, (unsigned char *)parts[i]->w, parts[i]->len * 8);
+  }
+  limage_header h = {LIMAGE_MAGIC,
+                     LIMAGE_VERSION,
+                     LIMAGE_LAYOUT,
+                     (int64_t)sum,
+                     w->heap.len,
+                     w->nsymbols,
+                     w->symbols.len,
+                     w->relocations.len,
+                     w->symbol_fixes.len,
+                     w->builtin_fixes.len,
+                     w->roots.len};
+  char *tmp = malloc(strlen(path) + 8);
+  sprintf(tmp, "%s.tmp", path);
+  FILE *f = fopen(tmp, "wb");
+  int ok = f && fwrite(&h, sizeof(h), 1, f) == 1;
+  for (int i = 0; i < 6 && ok; i++) {
+    ok = !parts[i]->len || fwrite(parts[i]->w, sizeof(int64_t),
+                                  parts[i]->len, f) == parts[i]->len;
+  }
+  if (f && fclose(f) != 0) {
+    ok = 0;
+  }
+#ifdef _WIN32
+  /* NOTE: rename does not replace a file there */
+  remove(path);
+#endif
+  ok = ok && rename(tmp, path) == 0;
+  if (!ok) {
+    remove(tmp);
+  }
+  free(tmp);
+  if (ok) {
+    return NULL;
+  }
+
+  char *msg = strerror(errno);
+  char *err = malloc(strlen(path) + strlen(msg) + 32);
+  sprintf(err, "Could not save %s: %s", path, msg);
+  lval *x = lval_err(err);
+  free(err);
+  return x;
+}
+
+/* Write the bindings of the global environment to "path" */
+static lval *lenv_save_image(lenv *e, const char *path) {
+  e = e->top;
+  limage w;
+  limage_init(&w);
+  for (int i = 0; i < e->count; i++) {
+    int64_t sym = limage_sym_val(&w, e->syms[i]);
+    int64_t v = limage_put(&w, e->vals[i]);
+    lwords_add(&w.roots, sym);
+    lwords_add(&w.roots, v);
+  }
+  lval *err = limage_write(&w, path);
+  limage_free(&w);
+  return err ? err : lval_sexpr();
+}
+
+/*
+ * Map the file "path" into memory, writable but private. NULL with errno set
+ * on failure.
+ */
+static char *limage_map(const char *path, size_t *len) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return NULL;
+  }
+  char *p = NULL;
+#ifndef _WIN32
+  struct stat st;
+  if (fstat(fileno(f), &st) == 0) {
+    *len = st.st_size;
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    /* NOTE: loading writes to every page, so copy them all in one go */
+    flags |= MAP_POPULATE;
+#endif
+    p = mmap(NULL, *len ? *len : 1, PROT_READ | PROT_WRITE, flags, fileno(f),
+             0);
+    p = p == MAP_FAILED ? NULL : p;
+  }
+#else
+  if (fseek(f, 0, SEEK_END) == 0) {
+    *len = ftell(f);
+    rewind(f);
+    p = malloc(*len ? *len : 1);
+    if (fread(p, 1, *len, f) != *len) {
+      free(p);
+      p = NULL;
+    }
+  }
+#endif
+  fclose(f);
+  return p;
+}
+
+static void limage_unmap(char *p, size_t len) {
+#ifndef _WIN32
+  munmap(p, len ? len : 1);
+#else
+  free(p);
+#endif
+}
+
+/*
+ * Whether "off" may be a pointer into the heap of an image: a fixnum,
+ * NULL if "null" is set, or an aligned offset of the heap
+ */
+static inline int limage_points(int64_t off, int64_t end, int null) {
+  if (off & 1) {
+    return 1;
+  }
+  if (off == 0) {
+    return null;
+  }
+  return off >= (int64_t)sizeof(limage_header) && off < end && !(off & 7);
+}
+
+/* Whether a fix at "at" is for the field "field" of a value of type "type" */
+static inline int limage_fixes(char *base, int64_t at, int64_t end,
+                               size_t field, int type) {
+  return limage_points(at - field, end, 0) && !(at & 1) &&
+         ((lval *)(base + at - field))->type == type;
+}
+
+/* The root "i" of the image "m" */
+static lval *limage_root(limage_mapping *m, int64_t i) {
+  int64_t v = m->roots[i];
+  return v & 1 ? (lval *)(intptr_t)v : (lval *)(m->base + v);
+}
+
+static void limage_close(limage_mapping *m) {
+  limage_unmap(m->base, m->len);
+  free(m);
+}
+
+/* Keep the image "m" mapped while its values are in use, see lispy_del */
+static void limage_keep(limage_mapping *m) {
+  m->next = lcur->root->images;
+  lcur->root->images = m;
+}
+
+/* Map the image "path" and make it ready to use, NULL or the error */
+static lval *limage_open(const char *path, limage_mapping **out) {
+  size_t len;
+  char *base = limage_map(path, &len);
+  if (!base) {
+    char *msg = strerror(errno);
+    char *err = malloc(strlen(path) + strlen(msg) + 32);
+    sprintf(err, "Could not load %s: %s", path, msg);
+    lval *x = lval_err(err);
+    free(err);
+    return x;
+  }
+
+  limage_header *h = (limage_header *)base;
+  int64_t words = (len - sizeof(limage_header)) / 8;
+  int64_t *sections[] = {&h->heap,         &h->symbol_words,
+                         &h->relocations,  &h->symbol_fixes,
+                         &h->builtin_fixes, &h->roots};
+  int fits = len >= sizeof(limage_header) && len % 8 == 0;
+  for (int i = 0; i < 6 && fits; i++) {
+    fits = *sections[i] >= 0 && *sections[i] <= words;
+    words -= fits ? *sections[i] : 0;
+  }
+  if (!fits || words != 0 || h->magic != LIMAGE_MAGIC ||
+      h->version != LIMAGE_VERSION || h->layout != LIMAGE_LAYOUT ||
+      h->symbols < 0 || h->symbols > h->symbol_words ||
+      h->symbol_fixes % 2 || h->builtin_fixes % 2) {
+    limage_unmap(base, len);
+    return lval_err("Not an image of this build of lispy!");
+  }
+  if (h->sum != (int64_t)lmodule_sum(LMODULE_SEED,
+                                     (unsigned char *)(h + 1),
+                                     len - sizeof(limage_header))) {
+    limage_unmap(base, len);
+    return lval_err("Image is damaged!");
+  }
+
+  int64_t end = sizeof(limage_header) + h->heap * 8;
+  int64_t *w = (int64_t *)(base + end);
+  int64_t *stop = w + h->symbol_words;
+  int ok = 1;
+
+  char **names = malloc(sizeof(char *) * (h->symbols + 1));
+  for (int64_t i = 0; i < h->symbols && ok; i++) {
+    int64_t n = *w >> 8;
+    ok = n >= 0 && n <= (stop - w - 1) * 8;
+    if (ok) {
+      names[i] = lval_intern_n((char *)(w + 1), n);
+      if (*w & LSYM_LOCAL) {
+        lsym_set_local(names[i]);
+      }
+      w += 1 + (n + 7) / 8;
+    }
+  }
+
+  int64_t *relocations = stop;
+  int64_t *heap = (int64_t *)(base + sizeof(limage_header));
+  ok = ok && h->relocations == (h->heap + 63) / 64;
+  for (int64_t i = 0; i < h->relocations && ok; i++) {
+    uint64_t bits = relocations[i];
+    while (bits && ok) {
+      int64_t at = i * 64 + __builtin_ctzll(bits);
+      bits &= bits - 1;
+      ok = at < h->heap && limage_points(heap[at], end, 1);
+      if (ok && heap[at] && !(heap[at] & 1)) {
+        *(char **)&heap[at] = base + heap[at];
+      }
+    }
+  }
+
+  int64_t *symbol_fixes = relocations + h->relocations;
+  for (int64_t i = 0; i < h->symbol_fixes && ok; i += 2) {
+    int64_t at = symbol_fixes[i];
+    int64_t sym = symbol_fixes[i + 1];
+    ok = limage_fixes(base, at, end, offsetof(lval, sym), LVAL_SYM) &&
+         sym >= 0 && sym < h->symbols;
+    if (ok) {
+      *(char **)(base + at) = names[sym];
+    }
+  }
+
+  int64_t *builtin_fixes = symbol_fixes + h->symbol_fixes;
+  for (int64_t i = 0; i < h->builtin_fixes && ok; i += 2) {
+    int64_t at = builtin_fixes[i];
+    int64_t sym = builtin_fixes[i + 1];
+    lbuiltin func = NULL;
+    ok = limage_fixes(base, at, end, offsetof(lval, builtin), LVAL_FUN) &&
+         sym >= 0 && sym < h->symbols;
+    for (int j = 0; ok && j < LBUILTIN_COUNT; j++) {
+      if (strcmp(lbuiltins[j].name, names[sym]) == 0) {
+        func = lbuiltins[j].func;
+      }
+    }
+    ok = ok && func;
+    if (ok) {
+      *(lbuiltin *)(base + at) = func;
+    }
+  }
+
+  int64_t *roots = builtin_fixes + h->builtin_fixes;
+  for (int64_t i = 0; i < h->roots && ok; i++) {
+    lval *v = (lval *)(base + roots[i]);
+    ok = limage_points(roots[i], end, 0);
+    /* NOTE: the start of a value, rather than somewhere inside one */
+    ok = ok && (roots[i] & 1 || (v->refs == LIMAGE_REFS &&
+                                 (unsigned)v->type <= LVAL_SEQ));
+  }
+  free(names);
+  if (!ok) {
+    limage_unmap(base, len);
+    return lval_err("Image is damaged!");
+  }
+
+  limage_mapping *m = malloc(sizeof(limage_mapping));
+  m->base = base;
+  m->len = len;
+  m->roots = roots;
+  m->nroots = h->roots;
+  m->next = NULL;
+  *out = m;
+  return NULL;
+}
+
+/* Define what the image "path" holds in the global environment */
+static lval *lenv_load_image(lenv *e, const char *path) {
+  limage_mapping *m;
+  lval *err = limage_open(path, &m);
+  if (err) {
+    return err;
+  }
+
+  /* NOTE: checked before anything is defined, so a bad image changes nothing */
+  int ok = m->nroots % 2 == 0;
+  for (int64_t i = 0; i < m->nroots && ok; i += 2) {
+    ok = lval_type(limage_root(m, i)) == LVAL_SYM;
+  }
+  if (!ok) {
+    limage_close(m);
+    return lval_err("Image is damaged!");
+  }
+  for (int64_t i = 0; i < m->nroots; i += 2) {
+    lenv_set(e->top, limage_root(m, i)->sym, limage_root(m, i + 1));
+  }
+  limage_keep(m);
+  return lval_sexpr();
+}
+
+/*
+ * Embedding
+ *
+ * The entry points of lispy.h make the interpreter they are given the current
+ * one for as long as they run, and put back whichever was current before, so
+ * a host may use several interpreters on one thread too.
+ *
+ * NOTE: they are the only names the library exports; everything else in this
+ * file is static, so it cannot clash with the names of a host.
+ */
+lispy *lispy_new(void) {
+  lispy *l = calloc(1, sizeof(lispy));
+  l->intern_mask = -1;
+  l->root = l;
+#ifdef LPAR_THREADS
+  pthread_mutex_init(&l->intern_lock, NULL);
+#endif
+
+  lispy *prev = lcur;
+  lcur = l;
+  l->amp = lval_intern("&");
+  l->env = lenv_new();
+  lenv_add_builtins(l->env);
+  lcur = prev;
+  return l;
+}
+
+void lispy_del(lispy *l) {
+  lispy *prev = lcur;
+  lcur = l;
+  lenv_del(l->env);
+#ifdef LPAR_THREADS
+  if (l->par) {
+    lpar_del(l->par);
+  }
+  pthread_mutex_destroy(&l->intern_lock);
+#endif
+  while (l->images) {
+    limage_mapping *next = l->images->next;
+    limage_close(l->images);
+    l->images = next;
+  }
+
+  for (int i = 0; i < LSLAB_CLASSES; i++) {
+    lslab *s = l->pools[i].slabs;
+    while (s) {
+      lslab *next = s->next;
+      free(s);
+      s = next;
+    }
+  }
+  for (int i = 0; i <= l->intern_mask; i++) {
+    if (l->intern_names[i]) {
+      /* NOTE: the flags byte in front is the start of the allocation */
+      free(l->intern_names[i] - 1);
+    }
+  }
+  free(l->intern_names);
+
+  lcur = prev == l ? NULL : prev;
+  free(l);
+}
+
+/*
+ * Read "src" as a REPL line and evaluate it in "e", printing the value or the
+ * parse error to "out" if given. Returns 1 for either error, 0 otherwise.
+ */
+static int lenv_eval_line(lenv *e, const char *src, FILE *out) {
+  int failed = 1;
+  lreader r;
+  lreader_init(&r, "<stdin>", src, strlen(src));
+  lval *x = lval_read(&r);
+  if (x) {
+    lval *y = lval_eval(e, x);
+    failed = lval_type(y) == LVAL_ERR;
+    if (out) {
+      lval_println(out, y);
+    }
+    lval_del(y);
+  } else {
+    if (out) {
+      fputs(r.err, out);
+    }
+    free(r.err);
+  }
+  return failed;
+}
+
+int lispy_eval_string(lispy *l, const char *src, FILE *out) {
+  lispy *prev = lcur;
+  lcur = l;
+  int failed = lenv_eval_line(l->env, src, out);
+
+  /* Hand the slabs emptied by this evaluation back in bulk */
+  lslab_release();
+  lcur = prev;
+  return failed;
+}
+
+int lispy_eval_scoped(lispy *l, const char *src, FILE *out) {
+  lispy *prev = lcur;
+  lcur = l;
+
+  /* NOTE: a frame like a lambda's, so '=' binds in it and not globally */
+  lenv *scope = lenv_new_frame();
+  scope->par = lenv_share(l->env);
+  scope->top = l->env->top;
+  int failed = lenv_eval_line(scope, src, out);
+  lenv_del(scope);
+
+  lslab_release();
+  lcur = prev;
+  return failed;
+}
+
+int lispy_eval_file(lispy *l, const char *path, FILE *out) {
+  lispy *prev = lcur;
+  lcur = l;
+
+  int failed = 0;
+  lval *x = lenv_load(l->env, path, out, &failed);
+  if (lval_type(x) == LVAL_ERR) {
+    if (out) {
+      lval_println(out, x);
+    }
+    failed = 1;
+  }
+  lval_del(x);
+
+  lcur = prev;
+  return failed;
+}
+
+int lispy_save_image(lispy *l, const char *path, FILE *out) {
+  lispy *prev = lcur;
+  lcur = l;
+  lval *x = lenv_save_image(l->env, path);
+  int failed = lval_type(x) == LVAL_ERR;
+  if (failed && out) {
+    lval_println(out, x);
+  }
+  lval_del(x);
+  lcur = prev;
+  return failed;
+}
+
+int lispy_load_image(lispy *l, const char *path, FILE *out) {
+  lispy *prev = lcur;
+  lcur = l;
+  lval *x = lenv_load_image(l->env, path);
+  int failed = lval_type(x) == LVAL_ERR;
+  if (failed && out) {
+    lval_println(out, x);
+  }
+  lval_del(x);
+  lcur = prev;
+  return failed;
+}
@@ -0,0 +1,57 @@
+#ifndef LISPY_H
+#define LISPY_H
+
+#include <stdio.h>
+
+/*
+ * Embedding the interpreter
+ *
+ * A "lispy" is a whole interpreter: its global environment, its symbol table
+ * and the memory all of its values live in. Interpreters share nothing with
+ * each other, so a multi-threaded host can run one per thread. An interpreter
+ * must only be used by one thread at a time, but it does not matter which.
+ */
+typedef struct lispy lispy;
+
+/* A new interpreter, with the builtins defined */
+lispy *lispy_new(void);
+
+/* Free an interpreter and everything in it */
+void lispy_del(lispy *l);
+
+/*
+ * Evaluate "src" the way the REPL does a line: all of it is one expression.
+ * Its value, or the parse error, is printed to "out" unless that is NULL.
+ * Returns 0, or 1 if "src" does not parse or evaluates to an error.
+ */
+int lispy_eval_string(lispy *l, const char *src, FILE *out);
+
+/*
+ * As lispy_eval_string, but in a scope of its own below the global one that
+ * goes away afterwards: '=' at the top of "src" binds there, so one
+ * evaluation does not leave anything behind for the next. 'def' still
+ * defines globally.
+ */
+int lispy_eval_scoped(lispy *l, const char *src, FILE *out);
+
+/*
+ * Run the script "path" ("-" for the standard input) the way 'load' does.
+ * Errors are printed to "out" unless that is NULL. Returns 0, or 1 if the
+ * file cannot be read, does not parse or an expression evaluates to an error.
+ * What is read from a regular file is cached next to it, e.g. "lib.lspy" in
+ * "lib.lispyc", and read from there until the file changes, unless the
+ * environment variable LISPY_CACHE is 0.
+ */
+int lispy_eval_file(lispy *l, const char *path, FILE *out);
+
+/*
+ * Write the global environment to the image "path", as 'save-image' does, or
+ * define everything the image "path" holds in the global environment, so an
+ * interpreter can start where another one left off without running its
+ * scripts again. Errors are printed to "out" unless that is NULL. Both
+ * return 0, or 1 if the image cannot be written or read.
+ */
+int lispy_save_image(lispy *l, const char *path, FILE *out);
+int lispy_load_image(lispy *l, const char *path, FILE *out);
+
+#endif
@@ -0,0 +1,320 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lispy.h"
+
+/*
+ * Scaling with the number of threads
+ *
+ * First every thread creates an interpreter of its own and evaluates the same
+ * expression in it over and over. Interpreters share no state, so the total
+ * number of evaluations a second should grow with the number of threads up to
+ * the number of cores.
+ *
+ * Then a single interpreter evaluates a 'pmap' and a 'preduce' over a big
+ * list, with its pool limited to 1, 2, ... threads through LISPY_THREADS.
+ *
+ * Then a new interpreter loads a script of 10000 lines: with caching turned
+ * off, then writing the cache of it, then from the cache (see lmodule_put in
+ * lispy.c). The script and its cache are written to the current directory
+ * and removed afterwards.
+ *
+ * Then the reader (see lreader_expr in lispy.c) gets 8 MB of random nested
+ * lists, numbers and symbols held in memory, as one Q-Expression, which
+ * evaluates to itself. The throughput includes freeing what was read.
+ *
+ * Then a lambda adding up 200 globals is called over and over, with more and
+ * more other globals defined, to give the cost of a lookup against the
+ * number of bindings (see lenv_find in lispy.c). The time per lookup
+ * includes its share of the addition and the call.
+ *
+ * Last each of "list_exprs" works on a list "xs" of 10^5 numbers: arithmetic
+ * over all of it, 'join', 'head' and binding it to "&". None of them should
+ * take more than linear time in the length of the list.
+ *
+ * Build with e.g. "cc -std=gnu11 -O2 lispy_bench.c lispy.c -lpthread" and run
+ * as "lispy_bench [max threads] [evaluations per thread]".
+ */
+static const char *setup = "def {sq} (\\ {x} {* x x})";
+static const char *expr =
+    "foldl + 0 (map sq (filter (\\ {x} {- x 7}) (join {} (range 1000))))";
+
+static const char *pexpr =
+    "preduce + 0 (pmap (\\ {x} {foldl + x (map sq (join {} (range 200)))}) "
+    "(join {} (range 4096)))";
+
+static int evals = 2000;
+
+static const char *module = "lispy_bench_module.lspy";
+static const char *module_cache = "lispy_bench_module.lispyc";
+static const int module_lines = 10000;
+
+static const size_t parse_size = 8 << 20;
+
+static const int lookup_syms = 200;
+static const int lookup_runs = 20000;
+
+static const int list_len = 100000;
+static const char *list_setup = "def {g} (\\ {& r} {len r})";
+static const char *list_exprs[] = {"eval (join {+} xs)", "eval (join {-} xs)",
+                                   "len (join xs xs xs xs)", "head xs",
+                                   "eval (join {g} xs)"};
+
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* What load_module does about the cache of the module */
+enum { LOAD_UNCACHED, LOAD_WRITING, LOAD_CACHED };
+
+/* The best time of a few loads of the module */
+double load_module(int how) {
+  setenv("LISPY_CACHE", how == LOAD_UNCACHED ? "0" : "1", 1);
+  double best = 0;
+  for (int i = 0; i < 5; i++) {
+    if (how != LOAD_CACHED) {
+      remove(module_cache);
+    }
+    lispy *l = lispy_new();
+    double start = now();
+    if (lispy_eval_file(l, module, stderr)) {
+      exit(1);
+    }
+    double t = now() - start;
+    lispy_del(l);
+    best = i == 0 || t < best ? t : best;
+  }
+  return best;
+}
+
+/* About "size" bytes of random nested lists, numbers and symbols in braces */
+char *parse_input(size_t size) {
+  char *s = malloc(size + 256);
+  char close[64];
+  int depth = 0;
+  size_t n = 0;
+  unsigned long r = 1;
+  s[n++] = '{';
+  while (n < size) {
+    r = r * 6364136223846793005UL + 1442695040888963407UL;
+    int k = r >> 60;
+    if (k < 2 && depth < 64) {
+      s[n++] = k ? '(' : '{';
+      close[depth++] = k ? ')' : '}';
+    } else if (k < 4 && depth) {
+      s[n++] = close[--depth];
+    } else if (k < 10) {
+      n += sprintf(s + n, "%ld", (long)(r >> 36 & 0xfffff) - 50000);
+    } else {
+      n += sprintf(s + n, "sym%lu", (r >> 32) % 1000);
+    }
+    s[n++] = k % 4 ? ' ' : '\n';
+  }
+  while (depth) {
+    s[n++] = close[--depth];
+  }
+  s[n++] = '}';
+  s[n] = '\0';
+  return s;
+}
+
+/*
+ * "def {<prefix>0 <prefix>1 ...} 1 1 ...", or with "sum" the lambda "f" that
+ * adds them up
+ */
+char *lookup_expr(const char *prefix, int n, int sum) {
+  char *s = malloc(32 * (n + 1));
+  size_t len = sprintf(s, sum ? "def {f} (\\ {x} {+ x" : "def {");
+  for (int i = 0; i < n; i++) {
+    len += sprintf(s + len, " %s%d", prefix, i);
+  }
+  if (sum) {
+    sprintf(s + len, "})");
+    return s;
+  }
+  len += sprintf(s + len, "}");
+  for (int i = 0; i < n; i++) {
+    len += sprintf(s + len, " 1");
+  }
+  return s;
+}
+
+/* The time of a global lookup with "n" other globals defined */
+double lookup(int n) {
+  lispy *l = lispy_new();
+  char *syms = lookup_expr("a", lookup_syms, 0);
+  char *others = lookup_expr("b", n, 0);
+  char *sum = lookup_expr("a", lookup_syms, 1);
+  int f = lispy_eval_string(l, syms, NULL);
+  f |= lispy_eval_string(l, others, NULL);
+  f |= lispy_eval_string(l, sum, NULL);
+  double best = 0;
+  for (int i = 0; i < 3; i++) {
+    double start = now();
+    for (int j = 0; j < lookup_runs; j++) {
+      f |= lispy_eval_string(l, "f 1", NULL);
+    }
+    double t = now() - start;
+    best = i == 0 || t < best ? t : best;
+  }
+  if (f) {
+    fprintf(stderr, "evaluation failed\n");
+    exit(1);
+  }
+  free(syms);
+  free(others);
+  free(sum);
+  lispy_del(l);
+  return best / ((double)lookup_runs * lookup_syms);
+}
+
+void *run(void *failed) {
+  lispy *l = lispy_new();
+  int f = lispy_eval_string(l, setup, NULL);
+  for (int i = 0; i < evals; i++) {
+    f |= lispy_eval_string(l, expr, NULL);
+  }
+  lispy_del(l);
+  *(int *)failed = f;
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int threads = argc > 1 ? atoi(argv[1]) : 4;
+  if (argc > 2) {
+    evals = atoi(argv[2]);
+  }
+  if (threads < 1 || evals < 1) {
+    fprintf(stderr, "usage: %s [max threads] [evaluations per thread]\n",
+            argv[0]);
+    return 1;
+  }
+
+  pthread_t *tids = malloc(sizeof(pthread_t) * threads);
+  int *failed = malloc(sizeof(int) * threads);
+  double base = 0;
+  printf("threads  evals/s  speedup\n");
+  for (int n = 1; n <= threads; n++) {
+    double start = now();
+    for (int i = 0; i < n; i++) {
+      pthread_create(&tids[i], NULL, run, &failed[i]);
+    }
+    for (int i = 0; i < n; i++) {
+      pthread_join(tids[i], NULL);
+      if (failed[i]) {
+        fprintf(stderr, "evaluation failed\n");
+        return 1;
+      }
+    }
+    double rate = n * evals / (now() - start);
+    if (n == 1) {
+      base = rate;
+    }
+    printf("%7d  %7.0f  %7.2f\n", n, rate, rate / base);
+  }
+  free(tids);
+  free(failed);
+
+  printf("\nthreads  pmap/s   speedup\n");
+  for (int n = 1; n <= threads; n++) {
+    char count[16];
+    snprintf(count, sizeof(count), "%d", n);
+    setenv("LISPY_THREADS", count, 1);
+
+    /* NOTE: a new interpreter, its pool is sized when first used */
+    lispy *l = lispy_new();
+    int f = lispy_eval_string(l, setup, NULL);
+    int runs = evals / 100 > 0 ? evals / 100 : 1;
+    double start = now();
+    for (int i = 0; i < runs; i++) {
+      f |= lispy_eval_string(l, pexpr, NULL);
+    }
+    double rate = runs / (now() - start);
+    lispy_del(l);
+    if (f) {
+      fprintf(stderr, "evaluation failed\n");
+      return 1;
+    }
+    if (n == 1) {
+      base = rate;
+    }
+    printf("%7d  %7.2f  %7.2f\n", n, rate, rate / base);
+  }
+
+  FILE *f = fopen(module, "w");
+  if (!f) {
+    perror(module);
+    return 1;
+  }
+  for (int i = 0; i < module_lines; i++) {
+    fprintf(f, "(def {f%d} (\\ {x y} {+ (* x %d) (len (list y \"%d\"))}))\n",
+            i, i, i);
+  }
+  fclose(f);
+  double uncached = load_module(LOAD_UNCACHED);
+  double writing = load_module(LOAD_WRITING);
+  double cached = load_module(LOAD_CACHED);
+  printf("\n%d lines  uncached %.2fms  writing the cache +%.2fms  "
+         "cached %.2fms  speedup %.2f\n",
+         module_lines, uncached * 1e3, (writing - uncached) * 1e3,
+         cached * 1e3, uncached / cached);
+  remove(module);
+  remove(module_cache);
+
+  char *input = parse_input(parse_size);
+  lispy *l = lispy_new();
+  double best = 0;
+  for (int i = 0; i < 5; i++) {
+    double start = now();
+    if (lispy_eval_string(l, input, NULL)) {
+      fprintf(stderr, "reading failed\n");
+      return 1;
+    }
+    double t = now() - start;
+    best = i == 0 || t < best ? t : best;
+  }
+  lispy_del(l);
+  double mb = strlen(input) / (double)(1 << 20);
+  printf("\nparse %.1f MB  %.2fms  %.1f MB/s\n", mb, best * 1e3, mb / best);
+  free(input);
+
+  printf("\nbindings  ns/lookup\n");
+  for (int n = 16; n <= 16384; n *= 8) {
+    printf("%8d  %9.1f\n", lookup_syms + n, lookup(n) * 1e9);
+  }
+
+  char *xs = malloc(16 * list_len);
+  size_t len = sprintf(xs, "def {xs} {");
+  for (int i = 0; i < list_len; i++) {
+    len += sprintf(xs + len, " %d", i);
+  }
+  sprintf(xs + len, "}");
+  l = lispy_new();
+  if (lispy_eval_string(l, xs, NULL) ||
+      lispy_eval_string(l, list_setup, NULL)) {
+    fprintf(stderr, "evaluation failed\n");
+    return 1;
+  }
+  free(xs);
+  printf("\n%d elements\n", list_len);
+  for (size_t i = 0; i < sizeof(list_exprs) / sizeof(char *); i++) {
+    best = 0;
+    for (int j = 0; j < 5; j++) {
+      double start = now();
+      if (lispy_eval_string(l, list_exprs[i], NULL)) {
+        fprintf(stderr, "evaluation failed\n");
+        return 1;
+      }
+      double t = now() - start;
+      best = j == 0 || t < best ? t : best;
+    }
+    printf("%-24s  %8.1fus\n", list_exprs[i], best * 1e6);
+  }
+  lispy_del(l);
+  return 0;
+}
@@ -1,11 +1,18 @@
-#include "mpc/mpc.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lispy.h"
+
+/*
+ * The REPL and script runner on top of the interpreter in lispy.c
+ *
+ * Build with e.g. "cc -std=gnu11 -O2 q_expressions.c lispy.c -ledit -lpthread".
+ */
 
 /* If we are compiling on Windows compile these functions */
 #ifdef _WIN32
-#include <string.h>
-
 static char buffer[2048];
 
 /* Fake readline function */
@@ -24,857 +31,346 @@ void add_history(char *unused) {}
 /* Otherwise include the editline headers */
 #else
 #include <editline/readline.h>
-#endif
-
-/* Forward Declarations */
-struct lval;
-struct lenv;
-typedef struct lval lval;
-typedef struct lenv lenv;
-lenv *lenv_new(void);
-void lenv_del(lenv *e);
-lval *builtin_eval(lenv *e, lval *a);
-lval *builtin_list(lenv *e, lval *a);
-
-/* Let's define function pointers to allow user-defined operations!
- *
- * NOTE: notice the first arg is a pointer to the environment
- * "To get an lval* we dereference lbuiltin and call it with a lenv* and a
- * lval*." Therefore lbuiltin must be a function pointer that takes an lenv* and
- * a lval* and returns a lval*.
- */
-typedef lval *(*lbuiltin)(lenv *, lval *);
 
-/* Create Enumeration of Possible lval Types */
-enum { LVAL_NUM, LVAL_ERR, LVAL_FUN, LVAL_SYM, LVAL_SEXPR, LVAL_QEXPR };
+/* The server (see serve) */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define LISPY_SERVER
+#endif
 
-/* Create Enumeration of Possible Error Types */
-enum { LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM };
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
+#ifdef LISPY_SERVER
 /*
- * S-expresisons are a variable length lists of other values (see the syntax
- * rule below) However, "struct" is fixed sized, so we have to use a double star
- * pointer to point to a list of "lval"s.
+ * Server mode
+ *
+ * Keeps one interpreter, with whatever the files on the command line defined,
+ * and evaluates requests sent to it over a Unix domain socket, so a client
+ * pays for starting up and loading its prelude only once.
+ *
+ * A request is a line, read like a REPL line, and the answer to it the line
+ * the REPL would print. Each request is evaluated in a scope of its own (see
+ * lispy_eval_scoped). A client may send any number of requests without
+ * waiting for the answers, which come back in order. Connections are served
+ * in turn as their requests arrive.
+ *
+ * Connections never block the server: answers are kept for a connection
+ * until it can take them, and while more than LCONN_OUT_MAX bytes of them are
+ * waiting no more of its requests are read or answered. A connection sending
+ * a request longer than LCONN_LINE_MAX bytes is closed.
+ *
+ * NOTE: 'print' still prints to the standard output of the server.
  */
-struct lval {
-  int type;
-
-  long num;
-  /* Error and Symbol types have some string data */
-  char *err;
-  char *sym;
-
-  /* Function, either a builtin or a lambda (builtin is NULL in this case)*/
-  lbuiltin builtin;
-  lenv *env;
-  lval *formals;
-  lval *body;
-
-  int count;
-  lval **cell;
-};
-
-lval *lval_num(long x) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_NUM;
-  v->num = x;
-  return v;
-}
-
-lval *lval_err(char *m) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
-  /*
-   * NOTE: C strings are null terminated, meaning that the final character is
-   * always '\0'; however, "strlen" only returns the length excluding the null
-   * terminator...
-   */
-  v->err = malloc(strlen(m) + 1);
-  strcpy(v->err, m);
-  return v;
-}
-
-lval *lval_sym(char *s) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
-  return v;
-}
-
-lval *lval_fun(lbuiltin func) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
-  v->builtin = func;
-  return v;
+#define LCONN_LINE_MAX (1 << 20)
+#define LCONN_OUT_MAX (1 << 20)
+
+typedef struct {
+  int fd;
+  /* The requests read but not answered yet */
+  char *buf;
+  size_t len;
+  size_t cap;
+  /* The answers: "out" writes into "obuf", "sent" of it went out */
+  FILE *out;
+  char *obuf;
+  size_t olen;
+  size_t sent;
+  int eof;
+} lconn;
+
+/* The bytes of answers "c" has not taken yet */
+size_t lconn_pending(lconn *c) { return c->olen - c->sent; }
+
+/* A new stream for the answers of "c" */
+void lconn_open(lconn *c) {
+  c->out = open_memstream(&c->obuf, &c->olen);
+  c->sent = 0;
+  /* NOTE: "obuf" and "olen" are only set when the stream is flushed */
+  fflush(c->out);
+}
+
+/* Read what "c" sent, 0 if that failed */
+int lconn_read(lconn *c) {
+  if (c->eof || c->len >= LCONN_LINE_MAX) {
+    return 1;
+  }
+  if (c->cap < LCONN_LINE_MAX + 1 && c->len + 1 >= c->cap) {
+    c->cap = c->cap ? c->cap * 2 : 4096;
+    c->cap = c->cap < LCONN_LINE_MAX + 1 ? c->cap : LCONN_LINE_MAX + 1;
+    c->buf = realloc(c->buf, c->cap);
+  }
+  /* NOTE: one room for the terminating '\0' of a last request */
+  ssize_t n = read(c->fd, c->buf + c->len, c->cap - c->len - 1);
+  if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return 1;
+  }
+  if (n <= 0) {
+    c->eof = 1;
+    return n == 0;
+  }
+  c->len += n;
+  return 1;
 }
 
-lval *lval_lambda(lval *formals, lval *body) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
-  v->builtin = NULL;
-
-  /* NOTE: Important! */
-  v->env = lenv_new();
-
-  v->formals = formals;
-  v->body = body;
-  return v;
-}
-
-lval *lval_sexpr(void) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_SEXPR;
-  v->count = 0;
-  /* NOTE: NULL is a special constant that points to memory location 0 */
-  v->cell = NULL;
-  return v;
-}
-
-lval *lval_qexpr(void) {
-  lval *v = malloc(sizeof(lval));
-  v->type = LVAL_QEXPR;
-  v->count = 0;
-  v->cell = NULL;
-  return v;
-}
-
-void lval_del(lval *v) {
-  switch (v->type) {
-  case LVAL_NUM:
-    break;
-  case LVAL_FUN:
-    if (!v->builtin) {
-      lenv_del(v->env);
-      lval_del(v->formals);
-      lval_del(v->body);
-    }
-    break;
-  case LVAL_ERR:
-    free(v->err);
-    break;
-  case LVAL_SYM:
-    free(v->sym);
-    break;
-  case LVAL_QEXPR:
-  case LVAL_SEXPR:
-    for (int i = 0; i < v->count; i++) {
-      /* NOTE: recursively! */
-      lval_del(v->cell[i]);
+/*
+ * Answer the complete requests in the buffer of "c" while it has room for
+ * their answers, 0 if what is left is too long to be a request
+ */
+int lconn_answer(lispy *l, lconn *c) {
+  if (!c->len) {
+    return 1;
+  }
+  size_t start = 0;
+  char *end = NULL;
+  while (lconn_pending(c) <= LCONN_OUT_MAX &&
+         (end = memchr(c->buf + start, '\n', c->len - start))) {
+    *end = '\0';
+    if (end > c->buf + start && end[-1] == '\r') {
+      end[-1] = '\0';
     }
-    /* NOTE: also free the memory allocated to contain the pointers */
-    free(v->cell);
-    break;
-  }
-
-  /* NOTE: free the memory allocated for the "lval" struct itself */
-  free(v);
-}
-
-lval *lval_read_num(mpc_ast_t *t) {
-  errno = 0;
-  long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
-}
-
-lval *lval_add(lval *v, lval *x) {
-  v->count++;
-  v->cell = realloc(v->cell, sizeof(lval *) * v->count);
-  v->cell[v->count - 1] = x;
-  return v;
-}
-
-lval *lval_read(mpc_ast_t *t) {
-  /* If Symbol or Number return conversion to that type */
-  if (strstr(t->tag, "number")) {
-    return lval_read_num(t);
+    lispy_eval_scoped(l, c->buf + start, c->out);
+    start = end - c->buf + 1;
+    fflush(c->out);
   }
+  memmove(c->buf, c->buf + start, c->len - start);
+  c->len -= start;
 
-  if (strstr(t->tag, "symbol")) {
-    return lval_sym(t->contents);
+  if (end || !c->len) {
+    return 1;
   }
 
-  lval *x = NULL;
-  /* If root (>) or sexpr then create empty list */
-  if (strcmp(t->tag, ">") == 0) {
-    x = lval_sexpr();
-  }
-  if (strstr(t->tag, "sexpr")) {
-    x = lval_sexpr();
+  /* NOTE: a last request without a newline is still answered */
+  if (c->eof) {
+    c->buf[c->len] = '\0';
+    lispy_eval_scoped(l, c->buf, c->out);
+    c->len = 0;
+    fflush(c->out);
+    return 1;
   }
-  if (strstr(t->tag, "qexpr")) {
-    x = lval_qexpr();
-  }
-  for (int i = 0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") == 0 ||
-        strcmp(t->children[i]->contents, ")") == 0 ||
-        strcmp(t->children[i]->contents, "{") == 0 ||
-        strcmp(t->children[i]->contents, "}") == 0 ||
-        strcmp(t->children[i]->tag, "regex") == 0) {
-      continue;
-    }
-    x = lval_add(x, lval_read(t->children[i]));
-  }
-  return x;
+  return c->len < LCONN_LINE_MAX;
 }
 
-void lval_print(lval *v);
-void lval_expr_print(lval *v, char open, char close) {
-  putchar(open);
-  for (int i = 0; i < v->count; i++) {
-    lval_print(v->cell[i]);
-    if (i != (v->count - 1)) {
-      putchar(' ');
+/* Write what "c" will take of its answers, 0 if it failed */
+int lconn_flush(lconn *c) {
+  while (lconn_pending(c)) {
+    ssize_t n = write(c->fd, c->obuf + c->sent, lconn_pending(c));
+    if (n < 0) {
+      return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK;
     }
+    c->sent += n;
   }
-  putchar(close);
-}
-
-void lval_print(lval *v) {
-  switch (v->type) {
-  case LVAL_NUM:
-    printf("%li", v->num);
-    break;
-  case LVAL_ERR:
-    printf("Error: %s", v->err);
-    break;
-  case LVAL_FUN:
-    if (v->builtin) {
-      printf("<builtin>");
-    } else {
-      printf("(\\");
-      lval_print(v->formals);
-      putchar(' ');
-      lval_print(v->body);
-      putchar(')');
-    }
-    break;
-  case LVAL_SYM:
-    printf("%s", v->sym);
-    break;
-  case LVAL_SEXPR:
-    lval_expr_print(v, '(', ')');
-    break;
-  case LVAL_QEXPR:
-    lval_expr_print(v, '{', '}');
-    break;
+  /* Start the next answers at the beginning of a new buffer */
+  if (c->sent) {
+    fclose(c->out);
+    free(c->obuf);
+    lconn_open(c);
   }
-}
-
-void lval_println(lval *v) {
-  lval_print(v);
-  putchar('\n');
-}
-
-lenv *lenv_copy(lenv *e);
-lval *lval_copy(lval *v) {
-  lval *x = malloc(sizeof(lval));
-  x->type = v->type;
-  switch (v->type) {
-  /* Copy Functions and Numbers Directly */
-  case LVAL_FUN:
-    if (v->builtin) {
-      x->builtin = v->builtin;
-    } else {
-      x->builtin = NULL;
-      x->env = lenv_copy(v->env);
-      x->formals = lval_copy(v->formals);
-      x->body = lval_copy(v->body);
-    }
-    break;
-  case LVAL_NUM:
-    x->num = v->num;
-    break;
-
-  /* Copy Strings using malloc and strcpy */
-  case LVAL_ERR:
-    x->err = malloc(strlen(v->err) + 1);
-    strcpy(x->err, v->err);
-    break;
-  case LVAL_SYM:
-    x->sym = malloc(strlen(v->sym) + 1);
-    strcpy(x->sym, v->sym);
-    break;
-
-  /* Copy Lists by copying each sub-expression */
-  case LVAL_SEXPR:
-  case LVAL_QEXPR:
-    x->count = v->count;
-    x->cell = malloc(sizeof(lval *) * x->count);
-    for (int i = 0; i < x->count; i++) {
-      x->cell[i] = lval_copy(v->cell[i]);
-    }
-    break;
-  }
-  return x;
+  return 1;
 }
 
 /*
- * Envroment structure encode a list of relationships between names and values
+ * Read, answer and write what "c" is ready for after "revents", and return
+ * what to wait for next, or 0 once it is done with or has to be closed
  */
-struct lenv {
-  /* NOTE: parent environment pointer! */
-  lenv *par;
-
-  int count;
-  char **syms;
-  lval **vals;
-};
-
-lenv *lenv_new(void) {
-  lenv *env = malloc(sizeof(lenv));
-  env->par = NULL;
-  env->count = 0;
-  env->syms = NULL;
-  env->vals = NULL;
-  return env;
-}
-
-lenv *lenv_copy(lenv *e) {
-  lenv *x = malloc(sizeof(lenv));
-  x->par = e->par;
-  x->count = e->count;
-  x->syms = malloc(sizeof(char *) * x->count);
-  x->vals = malloc(sizeof(lval *) * x->count);
-  for (int i = 0; i < x->count; i++) {
-    x->syms[i] = malloc(strlen(e->syms[i]) + 1);
-    strcpy(x->syms[i], e->syms[i]);
-    x->vals[i] = lval_copy(e->vals[i]);
-  }
-  return x;
-}
-
-void lenv_del(lenv *e) {
-  for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
-    lval_del(e->vals[i]);
-  }
-  free(e->syms);
-  free(e->vals);
-  free(e);
-}
-
-lval *lenv_get(lenv *e, lval *k) {
-  if (k->type == LVAL_SYM) {
-    for (int i = 0; i < e->count; i++) {
-      if (strcmp(e->syms[i], k->sym) == 0) {
-        return lval_copy(e->vals[i]);
-      }
+short lconn_serve(lispy *l, lconn *c, short revents) {
+  if ((revents & (POLLIN | POLLHUP | POLLERR)) && !lconn_read(c)) {
+    return 0;
+  }
+  /* NOTE: answers taken at once make room to answer more requests */
+  do {
+    if (!lconn_answer(l, c) || !lconn_flush(c)) {
+      return 0;
     }
-  }
+  } while (lconn_pending(c) <= LCONN_OUT_MAX && c->len &&
+           memchr(c->buf, '\n', c->len));
 
-  /*
-   * NOTE: if we cannot find the symbol in the current environment, get it from
-   * parent's!
-   */
-  if (e->par) {
-    return lenv_get(e->par, k);
-  }
-  return lval_err("unbound symbol!");
-}
-
-void lenv_put(lenv *e, lval *k, lval *v) {
-  if (k->type != LVAL_SYM) {
-    return;
+  short events = 0;
+  if (!c->eof && lconn_pending(c) <= LCONN_OUT_MAX) {
+    events |= POLLIN;
   }
-  for (int i = 0; i < e->count; i++) {
-    if (strcmp(e->syms[i], k->sym) == 0) {
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
-      return;
-    }
+  if (lconn_pending(c)) {
+    events |= POLLOUT;
   }
-
-  e->count++;
-  e->vals = realloc(e->vals, sizeof(lval *) * e->count);
-  e->syms = realloc(e->syms, sizeof(char *) * e->count);
-  e->vals[e->count - 1] = lval_copy(v);
-  e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-  strcpy(e->syms[e->count - 1], k->sym);
+  return events;
 }
 
-/*
- * Unlike lenv_put, this function define the val in the global env.
- */
-void lenv_def(lenv *e, lval *k, lval *v) {
-  while (e->par) {
-    e = e->par;
-  }
-  lenv_put(e, k, v);
+void lconn_del(lconn *c) {
+  close(c->fd);
+  fclose(c->out);
+  free(c->obuf);
+  free(c->buf);
+  free(c);
 }
 
-void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
-  lval *k = lval_sym(name);
-  lval *v = lval_fun(func);
-  lenv_put(e, k, v);
-  lval_del(k);
-  lval_del(v);
-}
-
-#define LASSERT(args, cond, err)                                               \
-  if (!(cond)) {                                                               \
-    lval_del(args);                                                            \
-    return lval_err(err);                                                      \
+int serve(lispy *l, const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: socket path too long\n", path);
+    return 1;
   }
+  strcpy(addr.sun_path, path);
 
-lval *lval_eval_sexpr(lenv *e, lval *v);
-lval *lval_eval(lenv *e, lval *v) {
-  if (v->type == LVAL_SYM) {
-    lval *x = lenv_get(e, v);
-    lval_del(v);
-    return x;
-  }
-  if (v->type == LVAL_SEXPR) {
-    return lval_eval_sexpr(e, v);
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (s < 0 || bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(s, 64) < 0) {
+    perror(path);
+    return 1;
   }
-  /* All other lval types remain the same */
-  return v;
-}
-
-lval *lval_pop(lval *v, size_t to_pop) {
-  lval *res = v->cell[to_pop];
-  memmove(&v->cell[to_pop], &v->cell[to_pop + 1],
-          sizeof(lval *) * (v->count - to_pop - 1));
-
-  v->count--;
-
-  /* NOTE: reallocate the memory used */
-  v->cell = realloc(v->cell, sizeof(lval *) * v->count);
-  return res;
-}
-
-lval *lval_take(lval *v, size_t to_move) {
-  /* NOTE: not the most efficient */
-  lval *res = lval_pop(v, to_move);
-  lval_del(v);
-  return res;
-}
+  /* A client that goes away must not take the server with it */
+  signal(SIGPIPE, SIG_IGN);
 
-/*
- * Call the function with a list of arguments
- * NOTE: Here we allow currying!
- */
-lval *lval_call(lenv *e, lval *f, lval *a) {
-  if (f->builtin) {
-    return f->builtin(e, a);
-  }
+  /*
+   * "fds[0]" is the socket, "fds[i]" the connection "conns[i - 1]"
+   *
+   * NOTE: the answer stream of a connection points into its lconn, so each
+   * lconn is allocated on its own and never moves
+   */
+  int count = 1;
+  int cap = 16;
+  struct pollfd *fds = malloc(sizeof(struct pollfd) * cap);
+  lconn **conns = malloc(sizeof(lconn *) * cap);
+  fds[0].fd = s;
+  fds[0].events = POLLIN;
 
-  while (a->count) {
-    if (f->formals->count == 0) {
-      lval_del(a);
-      return lval_err("Function passed too many arguments.");
+  while (1) {
+    if (poll(fds, count, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll");
+      return 1;
     }
 
-    lval *sym = lval_pop(f->formals, 0);
-    if (strcmp(sym->sym, "&") == 0) {
-      if (f->formals->count == 1) {
-        lval_del(a);
-        return lval_err("Function format invalid");
+    for (int i = count - 1; i > 0; i--) {
+      if (!fds[i].revents) {
+        continue;
+      }
+      lconn *c = conns[i - 1];
+      fds[i].events = lconn_serve(l, c, fds[i].revents);
+      if (!fds[i].events) {
+        lconn_del(c);
+        count--;
+        fds[i] = fds[count];
+        conns[i - 1] = conns[count - 1];
       }
-
-      /* Next formal should be bound to remaining arguments */
-      lval *next_sym = lval_pop(f->formals, 0);
-      lenv_put(f->env, next_sym, builtin_list(e, a));
-      lval_del(sym);
-      lval_del(next_sym);
-      break;
     }
 
-    lval *val = lval_pop(a, 0);
-
-    lenv_put(f->env, sym, val);
-    lval_del(sym);
-    lval_del(val);
-  }
-
-  /* Argument list is now bound so can be cleaned up */
-  lval_del(a);
-
-  /* If '&' remains in formal list bind to empty list */
-  if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0) {
-    if (f->formals->count != 2) {
-      return lval_err("Function format invalid.");
+    if (fds[0].revents & POLLIN) {
+      int fd = accept(s, NULL, NULL);
+      if (fd < 0) {
+        continue;
+      }
+      if (count == cap) {
+        cap *= 2;
+        fds = realloc(fds, sizeof(struct pollfd) * cap);
+        conns = realloc(conns, sizeof(lconn *) * cap);
+      }
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      fds[count].fd = fd;
+      fds[count].events = POLLIN;
+      lconn *c = calloc(1, sizeof(lconn));
+      conns[count - 1] = c;
+      c->fd = fd;
+      lconn_open(c);
+      count++;
     }
-
-    /* Pop and delete '&' symbol */
-    lval_del(lval_pop(f->formals, 0));
-
-    lval *sym = lval_pop(f->formals, 0);
-    lval *val = lval_qexpr();
-
-    lenv_put(f->env, sym, val);
-    lval_del(sym);
-    lval_del(val);
-  }
-
-  if (f->formals->count == 0) {
-    f->env->par = e;
-    return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-  } else {
-    /* Otherwise, return partially evaluated function */
-    return lval_copy(f);
   }
 }
+#endif
 
-lval *builtin_op(lenv *e, lval *a, char *op) {
-
-  /* Ensure all elements are numbers */
-  for (int i = 0; i < a->count; i++) {
-    if (a->cell[i]->type != LVAL_NUM) {
-      lval_del(a);
-      return lval_err("Cannot operate on non-number!");
-    }
-  }
-
-  /* Pop the first element */
-  lval *x = lval_pop(a, 0);
-
-  /* If no arguments and sub then perform unary negation */
-  if ((strcmp(op, "-") == 0) && a->count == 0) {
-    x->num = -x->num;
-  }
-
-  while (a->count > 0) {
-    /* Pop the next element */
-    lval *y = lval_pop(a, 0);
-    if (strcmp(op, "+") == 0) {
-      x->num += y->num;
-    } else if (strcmp(op, "-") == 0) {
-      x->num -= y->num;
-    } else if (strcmp(op, "*") == 0) {
-      x->num *= y->num;
-    } else if (strcmp(op, "/") == 0) {
-      if (y->num == 0) {
-        lval_del(x);
-        lval_del(y);
-        x = lval_err("Division By Zero!");
-        break;
-      }
-      x->num /= y->num;
-    } else if (strcmp(op, "min") == 0) {
-      x->num = x->num < y->num ? x->num : y->num;
-    } else if (strcmp(op, "max") == 0) {
-      x->num = x->num < y->num ? y->num : x->num;
+int main(int argc, char **argv) {
+  /*
+   * "-t" prints how long each file took, "-s socket" serves requests on the
+   * socket after running the files, "--image image" starts from an image
+   * made with 'save-image', the other arguments are files
+   */
+  int timing = 0;
+  char *server = NULL;
+  char *image = NULL;
+  int files = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-t") == 0) {
+      timing = 1;
+    } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+      image = argv[++i];
+      argv[i - 1] = argv[i] = NULL;
+#ifdef LISPY_SERVER
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      server = argv[++i];
+      argv[i - 1] = argv[i] = NULL;
+#endif
+    } else if (argv[i][0] == '-' && argv[i][1]) {
+      fprintf(stderr,
+              "usage: %s [-t] [-s socket] [--image image] [file | -]...\n",
+              argv[0]);
+      return 1;
     } else {
-      lval_del(x);
-      lval_del(y);
-      x = lval_err("Unsupported operator");
-      break;
+      files++;
     }
-    lval_del(y);
-  }
-  if (a->count > 0) {
-    lval_del(x);
-    x = lval_err("Too many args");
-  }
-  lval_del(a);
-  return x;
-}
-
-lval *builtin_add(lenv *e, lval *a) { return builtin_op(e, a, "+"); }
-lval *builtin_sub(lenv *e, lval *a) { return builtin_op(e, a, "-"); }
-lval *builtin_mul(lenv *e, lval *a) { return builtin_op(e, a, "*"); }
-lval *builtin_div(lenv *e, lval *a) { return builtin_op(e, a, "/"); }
-lval *builtin_min(lenv *e, lval *a) { return builtin_op(e, a, "min"); }
-lval *builtin_max(lenv *e, lval *a) { return builtin_op(e, a, "max"); }
-
-/* Support Q-Expression:
- * lispy> list 1 2 3 4
- * {1 2 3 4}
- * lispy> head (list 1 2 3 4)
- * {1}
- * lispy> eval {head (list 1 2 3 4)}
- * {1}
- * lispy> eval head (list 1 2 3 4)
- * 1
- * lispy> tail {tail tail tail}
- * {tail tail}
- * lispy> eval (tail {tail tail {5 6 7}})
- * {6 7}
- * lispy> eval (head {(+ 1 2) (+ 10 20)})
- * 3
- */
-/*
- * Takes a Q-Expression and returns a Q-Expression with only of the first
- * element
- */
-lval *builtin_head(lenv *e, lval *a) {
-  LASSERT(a, a->count == 1, "Function 'head' passed too many arguments!");
-  LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-          "Function 'head' passed incorrect type!");
-  LASSERT(a, a->cell[0]->count != 0, "Function 'head' passed {}!");
-
-  lval *v = lval_take(a, 0);
-  while (v->count > 1) {
-    lval_del(lval_pop(v, 1));
-  }
-  return v;
-}
-
-/*
- * Takes a Q-Expression and returns a Q-Expression with the first element
- * removed
- */
-lval *builtin_tail(lenv *e, lval *a) {
-  LASSERT(a, a->count == 1, "Function 'tail' passed too many arguments!");
-  LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-          "Function 'tail' passed incorrect type!");
-  LASSERT(a, a->cell[0]->count != 0, "Function 'tail' passed {}!");
-
-  if (a->cell[0]->count == 0) {
-    lval_del(a);
-    return lval_err("Function 'tail' passed {}!");
-  }
-
-  /* Take first argument */
-  lval *v = lval_take(a, 0);
-  lval_del(lval_pop(v, 0));
-  return v;
-}
-
-/*
- * Takes one or more arguments and returns a new Q-Expression containing the
- * arguments
- */
-lval *builtin_list(lenv *e, lval *a) {
-  a->type = LVAL_QEXPR;
-  return a;
-}
-
-/*
- * Takes a Q-Expression and evaluates it as if it were a S-Expression
- */
-lval *builtin_eval(lenv *e, lval *a) {
-  LASSERT(a, a->count == 1, "Function 'eval' passed too many arguments!");
-  LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-          "Function 'eval' passed incorrect type!");
-  lval *x = lval_take(a, 0);
-  x->type = LVAL_SEXPR;
-  return lval_eval(e, x);
-}
-
-lval *lval_join(lval *x, lval *y) {
-  while (y->count) {
-    x = lval_add(x, lval_pop(y, 0));
-  }
-  lval_del(y);
-  return x;
-}
-
-/*
- * Takes one or more Q-Expressions and returns a Q-Expression of them conjoined
- * together
- */
-lval *builtin_join(lenv *e, lval *a) {
-  for (int i = 0; i < a->count; i++) {
-    LASSERT(a, a->cell[i]->type == LVAL_QEXPR,
-            "Function 'join' passed incorrect type.");
   }
-  lval *x = lval_pop(a, 0);
-  while (a->count) {
-    x = lval_join(x, lval_pop(a, 0));
-  }
-  lval_del(a);
-  return x;
-}
-
-lval *builtin_cons(lenv *e, lval *a) {
-  LASSERT(a, a->count > 1, "Function 'cons' passed too few arguments!");
-  LASSERT(a, a->cell[1]->type == LVAL_QEXPR && a->cell[0]->type == LVAL_NUM,
-          "Function 'cons' passed wrong types!");
-  a->type = LVAL_QEXPR;
-  return a;
-}
-
-lval *builtin_var(lenv *e, lval *a, char *func) {
-  LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-          "Function 'def' passed incorrect type!");
 
-  lval *syms = a->cell[0];
-  for (int i = 0; i < syms->count; i++) {
-    LASSERT(a, syms->cell[i]->type == LVAL_SYM,
-            "Function 'def' cannot define non-symbol");
-  }
-  /* Check correct number of symbols and values */
-  LASSERT(a, syms->count == a->count - 1,
-          "Function 'def' cannot define incorrect number of values to symbols");
-  for (int i = 0; i < syms->count; i++) {
-    /* If 'def' define in globally. If 'put' define in locally */
-    if (strcmp(func, "def") == 0) {
-      lenv_def(e, syms->cell[i], a->cell[i + 1]);
+  lispy *l = lispy_new();
+  if (image) {
+    double start = now();
+    if (lispy_load_image(l, image, stderr)) {
+      lispy_del(l);
+      return 1;
     }
-    if (strcmp(func, "=") == 0) {
-      lenv_put(e, syms->cell[i], a->cell[i + 1]);
+    if (timing) {
+      fprintf(stderr, "%s: %.3fs\n", image, now() - start);
     }
   }
-  lval_del(a);
-  return lval_sexpr();
-}
-
-lval *builtin_put(lenv *e, lval *a) { return builtin_var(e, a, "="); }
-
-lval *builtin_def(lenv *e, lval *a) { return builtin_var(e, a, "def"); }
-
-lval *builtin_lambda(lenv *e, lval *a) {
-  /* Check two arguments, each of which are Q-Expresisons */
-  LASSERT(a, a->count == 2, "Wrong number of arg to lambda definition");
-  LASSERT(a, a->cell[0]->type == LVAL_QEXPR && a->cell[1]->type == LVAL_QEXPR,
-          "Wrong type for arg or body to lambda definition");
-
-  /* Sanity check */
-  for (int i = 0; i < a->cell[0]->count; i++) {
-    LASSERT(a, a->cell[0]->cell[i]->type == LVAL_SYM,
-            "Wrong type for arg to lambda definition");
-  }
-  lval *formals = lval_pop(a, 0);
-  lval *body = lval_pop(a, 0);
-  lval_del(a);
-  return lval_lambda(formals, body);
-}
-
-void lenv_add_builtins(lenv *e) {
-  /* List Functions */
-  lenv_add_builtin(e, "list", builtin_list);
-  lenv_add_builtin(e, "head", builtin_head);
-  lenv_add_builtin(e, "tail", builtin_tail);
-  lenv_add_builtin(e, "eval", builtin_eval);
-  lenv_add_builtin(e, "join", builtin_join);
-  lenv_add_builtin(e, "min", builtin_min);
-  lenv_add_builtin(e, "max", builtin_max);
-
-  /* Mathematical Functions */
-  lenv_add_builtin(e, "+", builtin_add);
-  lenv_add_builtin(e, "-", builtin_sub);
-  lenv_add_builtin(e, "*", builtin_mul);
-  lenv_add_builtin(e, "/", builtin_div);
-
-  /* Variable Functions */
-  lenv_add_builtin(e, "def", builtin_def);
-  lenv_add_builtin(e, "=", builtin_put);
-
-  /* Lambda Function */
-  lenv_add_builtin(e, "\\", builtin_lambda);
-}
 
-lval *lval_eval_sexpr(lenv *e, lval *v) {
-
-  for (int i = 0; i < v->count; i++) {
-    v->cell[i] = lval_eval(e, v->cell[i]);
-  }
-  /* Error checking */
-  for (int i = 0; i < v->count; i++) {
-    if (v->cell[i]->type == LVAL_ERR) {
-      return lval_take(v, i);
+  /* Run the files given instead of the REPL */
+  if (files || server) {
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+      if (!argv[i] || strcmp(argv[i], "-t") == 0) {
+        continue;
+      }
+      double start = now();
+      if (lispy_eval_file(l, argv[i], stdout)) {
+        status = 1;
+      }
+      if (timing) {
+        fflush(stdout);
+        fprintf(stderr, "%s: %.3fs\n", argv[i], now() - start);
+      }
     }
+#ifdef LISPY_SERVER
+    if (server) {
+      status = serve(l, server);
+    }
+#endif
+    lispy_del(l);
+    return status;
   }
 
-  /* Empty expression */
-  if (v->count == 0) {
-    return v;
-  }
-
-  /* Single expression */
-  if (v->count == 1) {
-    return lval_take(v, 0);
-  }
-
-  /* Ensure first element is symbol */
-  lval *f = lval_pop(v, 0);
-  if (f->type != LVAL_FUN) {
-    lval_del(f);
-    lval_del(v);
-    return lval_err("First element is not a function!");
-  }
-
-  return lval_call(e, f, v);
-}
-
-int main(int argc, char **argv) {
-
-  /* Create Some Parsers */
-  mpc_parser_t *Number = mpc_new("number");
-  mpc_parser_t *Symbol = mpc_new("symbol");
-  mpc_parser_t *Sexpr = mpc_new("sexpr");
-  mpc_parser_t *Qexpr = mpc_new("qexpr");
-  mpc_parser_t *Expr = mpc_new("expr");
-  mpc_parser_t *Lispy = mpc_new("lispy");
-
-  /*
-   * Define them with the following language
-   *
-   * The syntactic elements of Lisp are 'symbolic expressions', a.k.a.
-   * 's-expressions' Both programs and data are represented as s-expressions: an
-   * s-expresison may either an 'atom' or 'list'
-   *
-   * Examples of atoms include:
-   *   100
-   *   hyphenated-name
-   *   nil
-   *   *some-global*
-   *
-   * A list is a sequence of either atoms or other lists separated by blancks
-   * and enclosed in parentheses.
-   *
-   * Examples of lists include:
-   *   (1 2 3 4)
-   *   (george kate james joyce)
-   *   (a (b c ) (d (e f)))
-   *   () // empty expression
-   *
-   * p.s. number could be negative and we allow multiple preceding zeros
-   */
-  mpca_lang(
-      MPCA_LANG_DEFAULT,
-      "																										      \
-			  number		: /-?[0-9]+/ ;													      \
-				symbol		: /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;  	      \
-				sexpr 		: '(' <expr>* ')';                            \
-				qexpr     : '{' <expr>* '}';                            \
-				expr			: <number> | <symbol> | <sexpr> | <qexpr> ;   \
-				lispy		  : /^/ <expr>* /$/ ;					      						\
-			",
-      Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
-
   puts("Lispy Version 0.0.0.0.1");
   puts("Press Ctrl+c to Exit\n");
 
-  lenv *e = lenv_new();
-  lenv_add_builtins(e);
-
   while (1) {
     char *input = readline("lispy> ");
-
-    add_history(input);
-
-    /*
-     * typedef struct mpc_ast_t {
-     *   char* tag;
-     *   char* contents;
-     *   mpc_state_t state;
-     *   int children_num;
-     *   struct mpc_ast_t** children;
-     * } mpc_ast_t;
-     */
-    /* Attempt to parse the user input and print out AST */
-    mpc_result_t r;
-    if (mpc_parse("<stdin>", input, Lispy, &r)) {
-      // lval result = eval(r.output);
-      // lval_println(result);
-      lval *result = lval_eval(e, lval_read(r.output));
-      lval_println(result);
-      lval_del(result);
-
-      mpc_ast_delete(r.output);
-    } else {
-      mpc_err_print(r.error);
-      mpc_err_delete(r.error);
+    if (!input) {
+      break;
     }
 
+    add_history(input);
+    lispy_eval_string(l, input, stdout);
     free(input);
   }
-  lenv_del(e);
-
-  /* Undefine and delete the parsers */
-  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+  lispy_del(l);
   return 0;
 }